@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "TDMMTRC1"
+
+/*
+ * Latencies go into a log-linear histogram: values below HIST_LINEAR are counted
+ * exactly and every power-of-two range above is split into HIST_SUB_COUNT linear
+ * sub-buckets, so a bucket is never wider than 1/8 of its value.
+ */
+#define HIST_SUB_SHIFT 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_SHIFT)
+#define HIST_LINEAR (2 * HIST_SUB_COUNT)
+#define HIST_BUCKETS (HIST_LINEAR + (64 - HIST_SUB_SHIFT - 1) * HIST_SUB_COUNT)
+
+typedef struct latency_hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+} latency_hist;
+
+/*
+ * Maps the live pointers of a recorded program to their slots with linear
+ * probing. Slots freed by the program are reused so the slot count tracks the
+ * peak number of live blocks rather than the number of allocations.
+ */
+struct trace_slot_map {
+    void** keys;
+    uint32_t* values;
+    size_t capacity;
+    size_t used;
+    uint32_t* free_slots;
+    size_t free_count;
+    size_t free_capacity;
+};
+
+static double elapsed_ns(struct timespec start, struct timespec end) {
+    return (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
+}
+
+static void* xrealloc(void* ptr, size_t size) {
+    void* grown = realloc(ptr, size);
+    if (grown == NULL) {
+        fprintf(stderr, "Error: out of memory in benchmark harness\n");
+        exit(1);
+    }
+    return grown;
+}
+
+static void trace_push(trace* t, trace_op_e kind, uint32_t slot, size_t size) {
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity * 2 : 1024;
+        t->ops = xrealloc(t->ops, t->capacity * sizeof(trace_op));
+    }
+    trace_op* op = &t->ops[t->count++];
+    memset(op, 0, sizeof(*op));
+    op->kind = (uint8_t)kind;
+    op->slot = slot;
+    op->size = size;
+}
+
+static void trace_reset(trace* t, uint32_t slots) {
+    trace_destroy(t);
+    t->slots = slots;
+}
+
+// Uniform in [0, 1).
+static double rand_unit(unsigned* seed) {
+    return (double)rand_r(seed) / ((double)RAND_MAX + 1.0);
+}
+
+static size_t uniform_size(unsigned* seed, size_t min_size, size_t max_size) {
+    return min_size + (size_t)(rand_unit(seed) * (double)(max_size - min_size + 1));
+}
+
+static size_t pareto_size(unsigned* seed, size_t min_size, size_t max_size, double alpha) {
+    double size = (double)min_size / pow(1.0 - rand_unit(seed), 1.0 / alpha);
+    return size >= (double)max_size ? max_size : (size_t)size;
+}
+
+static void trace_random_slots(trace* t, size_t count, uint32_t slots, size_t min_size, size_t max_size,
+                               double alpha, unsigned seed) {
+    trace_reset(t, slots);
+    char* live = calloc(slots, 1);
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t slot = (uint32_t)(rand_r(&seed) % slots);
+        if (live[slot]) {
+            trace_push(t, TRACE_FREE, slot, 0);
+        } else {
+            size_t size = alpha > 0 ? pareto_size(&seed, min_size, max_size, alpha) : uniform_size(&seed, min_size, max_size);
+            trace_push(t, TRACE_MALLOC, slot, size);
+        }
+        live[slot] = !live[slot];
+    }
+    free(live);
+}
+
+void trace_uniform(trace* t, size_t count, uint32_t slots, size_t min_size, size_t max_size, unsigned seed) {
+    trace_random_slots(t, count, slots, min_size, max_size, 0, seed);
+}
+
+void trace_power_law(trace* t, size_t count, uint32_t slots, size_t min_size, size_t max_size, double alpha, unsigned seed) {
+    trace_random_slots(t, count, slots, min_size, max_size, alpha, seed);
+}
+
+void trace_producer_consumer(trace* t, size_t count, uint32_t slots, size_t min_size, size_t max_size, unsigned seed) {
+    trace_reset(t, slots);
+    size_t head = 0, depth = 0;
+    uint32_t max_burst = slots / 4 ? slots / 4 : 1;
+
+    while (t->count < count) {
+        size_t produce = 1 + rand_r(&seed) % max_burst;
+        for (; produce > 0 && depth < slots && t->count < count; produce--, depth++)
+            trace_push(t, TRACE_MALLOC, (uint32_t)((head + depth) % slots), uniform_size(&seed, min_size, max_size));
+
+        size_t consume = 1 + rand_r(&seed) % max_burst;
+        for (; consume > 0 && depth > 0 && t->count < count; consume--, depth--) {
+            trace_push(t, TRACE_FREE, (uint32_t)head, 0);
+            head = (head + 1) % slots;
+        }
+    }
+}
+
+static size_t slot_map_probe(trace_slot_map* map, void* ptr) {
+    size_t i = ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL & (map->capacity - 1);
+    while (map->keys[i] != NULL && map->keys[i] != ptr) i = (i + 1) & (map->capacity - 1);
+    return i;
+}
+
+static void slot_map_grow(trace_slot_map* map) {
+    void** old_keys = map->keys;
+    uint32_t* old_values = map->values;
+    size_t old_capacity = map->capacity;
+
+    map->capacity = old_capacity ? old_capacity * 2 : 1024;
+    map->keys = xrealloc(NULL, map->capacity * sizeof(void*));
+    map->values = xrealloc(NULL, map->capacity * sizeof(uint32_t));
+    memset(map->keys, 0, map->capacity * sizeof(void*));
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_keys[i] == NULL) continue;
+        size_t j = slot_map_probe(map, old_keys[i]);
+        map->keys[j] = old_keys[i];
+        map->values[j] = old_values[i];
+    }
+    free(old_keys);
+    free(old_values);
+}
+
+// Removes entry i, shifting later entries of its probe run back so lookups never stop early.
+static void slot_map_erase(trace_slot_map* map, size_t i) {
+    size_t mask = map->capacity - 1;
+    size_t j = i;
+
+    map->keys[i] = NULL;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (map->keys[j] == NULL) break;
+        size_t home = ((uintptr_t)map->keys[j] >> 4) * 0x9E3779B97F4A7C15ULL & mask;
+        // Entry j may move into the hole unless its home lies cyclically in (i, j].
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            map->keys[i] = map->keys[j];
+            map->values[i] = map->values[j];
+            map->keys[j] = NULL;
+            i = j;
+        }
+    }
+    map->used--;
+}
+
+void trace_record_malloc(trace* t, void* ptr, size_t size) {
+    if (ptr == NULL) return;
+    if (t->recorder == NULL) {
+        t->recorder = xrealloc(NULL, sizeof(trace_slot_map));
+        memset(t->recorder, 0, sizeof(trace_slot_map));
+    }
+
+    trace_slot_map* map = t->recorder;
+    if ((map->used + 1) * 2 > map->capacity) slot_map_grow(map);
+
+    uint32_t slot = map->free_count ? map->free_slots[--map->free_count] : t->slots++;
+    size_t i = slot_map_probe(map, ptr);
+    if (map->keys[i] == NULL) map->used++;
+    map->keys[i] = ptr;
+    map->values[i] = slot;
+    trace_push(t, TRACE_MALLOC, slot, size);
+}
+
+void trace_record_free(trace* t, void* ptr) {
+    trace_slot_map* map = t->recorder;
+    if (ptr == NULL || map == NULL) return;
+
+    size_t i = slot_map_probe(map, ptr);
+    if (map->keys[i] == NULL) return;
+
+    uint32_t slot = map->values[i];
+    slot_map_erase(map, i);
+    if (map->free_count == map->free_capacity) {
+        map->free_capacity = map->free_capacity ? map->free_capacity * 2 : 256;
+        map->free_slots = xrealloc(map->free_slots, map->free_capacity * sizeof(uint32_t));
+    }
+    map->free_slots[map->free_count++] = slot;
+    trace_push(t, TRACE_FREE, slot, 0);
+}
+
+int trace_save(const trace* t, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return -1;
+
+    uint64_t counts[2] = {t->count, t->slots};
+    int ok = fwrite(TRACE_MAGIC, 1, 8, file) == 8 && fwrite(counts, sizeof(uint64_t), 2, file) == 2 &&
+             fwrite(t->ops, sizeof(trace_op), t->count, file) == t->count;
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+// Checks that every free empties a filled slot and every malloc fills an empty one.
+static bool trace_valid(const trace* t) {
+    char* live = calloc(t->slots ? t->slots : 1, 1);
+    bool valid = live != NULL;
+
+    for (size_t i = 0; valid && i < t->count; i++) {
+        const trace_op* op = &t->ops[i];
+        valid = op->slot < t->slots && (op->kind == TRACE_MALLOC ? !live[op->slot] : op->kind == TRACE_FREE && live[op->slot]);
+        if (valid) live[op->slot] = op->kind == TRACE_MALLOC;
+    }
+    free(live);
+    return valid;
+}
+
+int trace_load(trace* t, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return -1;
+
+    char magic[8];
+    uint64_t counts[2];
+    memset(t, 0, sizeof(*t));
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 || fread(counts, sizeof(uint64_t), 2, file) != 2 ||
+        counts[1] > UINT32_MAX || counts[0] > SIZE_MAX / sizeof(trace_op)) {
+        fclose(file);
+        return -1;
+    }
+
+    t->count = t->capacity = counts[0];
+    t->slots = (uint32_t)counts[1];
+    t->ops = malloc(t->count * sizeof(trace_op) + 1);
+    int ok = t->ops != NULL && fread(t->ops, sizeof(trace_op), t->count, file) == t->count && trace_valid(t);
+    fclose(file);
+
+    if (!ok) {
+        trace_destroy(t);
+        return -1;
+    }
+    return 0;
+}
+
+void trace_destroy(trace* t) {
+    if (t->recorder) {
+        free(t->recorder->keys);
+        free(t->recorder->values);
+        free(t->recorder->free_slots);
+        free(t->recorder);
+    }
+    free(t->ops);
+    memset(t, 0, sizeof(*t));
+}
+
+static int hist_bucket(uint64_t ns) {
+    if (ns < HIST_LINEAR) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (msb - HIST_SUB_SHIFT)) & (HIST_SUB_COUNT - 1);
+    return HIST_LINEAR + (msb - HIST_SUB_SHIFT - 1) * HIST_SUB_COUNT + sub;
+}
+
+// Midpoint of the range of values counted in bucket b.
+static double hist_value(int b) {
+    if (b < HIST_LINEAR) return b;
+    int msb = (b - HIST_LINEAR) / HIST_SUB_COUNT + HIST_SUB_SHIFT + 1;
+    int sub = (b - HIST_LINEAR) % HIST_SUB_COUNT;
+    double width = (double)(1ULL << (msb - HIST_SUB_SHIFT));
+    return (double)(1ULL << msb) + sub * width + width / 2;
+}
+
+static double hist_percentile(const latency_hist* hist, double fraction) {
+    uint64_t rank = (uint64_t)ceil(fraction * (double)hist->total);
+    uint64_t seen = 0;
+
+    if (rank == 0) rank = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist->counts[b];
+        if (seen >= rank) return hist_value(b);
+    }
+    return 0;
+}
+
+// Cost of one clock_gettime pair, subtracted from every timed operation.
+static double timer_overhead_ns(void) {
+    static double overhead = -1;
+    if (overhead >= 0) return overhead;
+
+    struct timespec start, end;
+    overhead = 1e9;
+    for (int i = 0; i < 1000; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ns = elapsed_ns(start, end);
+        if (ns < overhead) overhead = ns;
+    }
+    return overhead;
+}
+
+static void free_live(const trace* t, const bench_allocator* alloc, void** slots) {
+    for (uint32_t i = 0; i < t->slots; i++) {
+        alloc->free(slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+// Replays a trace untimed per operation, writing the first byte of every block as a program would.
+static double replay_throughput(const trace* t, const bench_allocator* alloc, void** slots) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < t->count; i++) {
+        const trace_op* op = &t->ops[i];
+        if (op->kind == TRACE_MALLOC) {
+            char* ptr = alloc->malloc(op->size);
+            if (ptr) *ptr = 1;
+            slots[op->slot] = ptr;
+        } else {
+            alloc->free(slots[op->slot]);
+            slots[op->slot] = NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ns(start, end);
+}
+
+// Replays a trace timing every operation. Each new block has all its pages touched outside the timed region, so the peak RSS reflects the live set.
+static void replay_latency(const trace* t, const bench_allocator* alloc, void** slots, latency_hist* hist) {
+    struct timespec start, end;
+    double overhead = timer_overhead_ns();
+    long page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < t->count; i++) {
+        const trace_op* op = &t->ops[i];
+        char* ptr = NULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (op->kind == TRACE_MALLOC) ptr = alloc->malloc(op->size);
+        else alloc->free(slots[op->slot]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ns = elapsed_ns(start, end) - overhead;
+        hist->counts[hist_bucket(ns > 0 ? (uint64_t)ns : 0)]++;
+        hist->total++;
+
+        if (op->kind == TRACE_MALLOC) {
+            for (size_t offset = 0; ptr && offset < op->size; offset += page) ptr[offset] = 1;
+            slots[op->slot] = ptr;
+        } else {
+            slots[op->slot] = NULL;
+        }
+    }
+}
+
+static void reset_allocator(const bench_allocator* alloc) {
+    if (alloc->init) alloc->init(alloc->strat);
+}
+
+int bench_replay(const trace* t, const bench_allocator* alloc, bench_result* result) {
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        struct rusage usage;
+        void** slots = calloc(t->slots ? t->slots : 1, sizeof(void*));
+        latency_hist* hist = calloc(1, sizeof(latency_hist));
+        bench_result child = {0};
+
+        // The child starts out sharing the parent's pages; only growth beyond them is the replay's.
+        getrusage(RUSAGE_SELF, &usage);
+        child.peak_rss_kb = usage.ru_maxrss;
+
+        reset_allocator(alloc);
+        double ns = replay_throughput(t, alloc, slots);
+        free_live(t, alloc, slots);
+
+        reset_allocator(alloc);
+        replay_latency(t, alloc, slots, hist);
+        free_live(t, alloc, slots);
+
+        child.ops = t->count;
+        child.ops_per_sec = ns > 0 ? t->count / (ns / 1e9) : 0;
+        child.p50_ns = hist_percentile(hist, 0.50);
+        child.p99_ns = hist_percentile(hist, 0.99);
+        child.p999_ns = hist_percentile(hist, 0.999);
+
+        ssize_t written = write(fds[1], &child, sizeof(child));
+        _exit(written == sizeof(child) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bench_result child;
+    ssize_t got = read(fds[0], &child, sizeof(child));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || got != sizeof(child) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    *result = child;
+    result->peak_rss_kb = usage.ru_maxrss > child.peak_rss_kb ? usage.ru_maxrss - child.peak_rss_kb : 0;
+    return 0;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void bench_size_latency(const trace* background, const bench_allocator* alloc, size_t size, int samples,
+                        double* malloc_ns, double* free_ns) {
+    void** slots = calloc(background->slots ? background->slots : 1, sizeof(void*));
+    double* malloc_times = malloc(samples * sizeof(double));
+    double* free_times = malloc(samples * sizeof(double));
+    double overhead = timer_overhead_ns();
+    struct timespec start, end;
+
+    reset_allocator(alloc);
+    replay_throughput(background, alloc, slots);
+
+    for (int i = 0; i < samples; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        void* ptr = alloc->malloc(size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        malloc_times[i] = elapsed_ns(start, end) - overhead;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        alloc->free(ptr);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free_times[i] = elapsed_ns(start, end) - overhead;
+    }
+    free_live(background, alloc, slots);
+
+    qsort(malloc_times, samples, sizeof(double), compare_double);
+    qsort(free_times, samples, sizeof(double), compare_double);
+    *malloc_ns = malloc_times[samples / 2] > 0 ? malloc_times[samples / 2] : 0;
+    *free_ns = free_times[samples / 2] > 0 ? free_times[samples / 2] : 0;
+
+    free(slots);
+    free(malloc_times);
+    free(free_times);
+}
+
+void bench_run_all(const trace* workloads, const char* const* workload_names, int workload_count,
+                   const bench_allocator* allocators, int allocator_count, FILE* csv) {
+    fprintf(csv, "Workload,Allocator,Ops,OpsPerSec,P50(ns),P99(ns),P999(ns),PeakRSS(KB)\n");
+
+    for (int w = 0; w < workload_count; w++) {
+        printf("Workload %s (%zu ops): \n", workload_names[w], workloads[w].count);
+        for (int a = 0; a < allocator_count; a++) {
+            bench_result result;
+            if (bench_replay(&workloads[w], &allocators[a], &result) != 0) {
+                printf("%s: replay failed\n", allocators[a].name);
+                continue;
+            }
+
+            fprintf(csv, "%s,%s,%zu,%.0f,%.0f,%.0f,%.0f,%ld\n", workload_names[w], allocators[a].name, result.ops,
+                    result.ops_per_sec, result.p50_ns, result.p99_ns, result.p999_ns, result.peak_rss_kb);
+            printf("%s: %.0f ops/sec, p50 %.0f ns, p99 %.0f ns, p999 %.0f ns, peak RSS %ld KB\n", allocators[a].name,
+                   result.ops_per_sec, result.p50_ns, result.p99_ns, result.p999_ns, result.peak_rss_kb);
+        }
+        printf("\n");
+    }
+}
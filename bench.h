@@ -0,0 +1,133 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "tdmm.h"
+
+/*
+ * An allocation trace is a sequence of malloc and free operations on numbered
+ * slots: a malloc fills a slot with a new block and a free empties it. Slots
+ * stand in for the program's pointers, so a trace can be replayed against any
+ * allocator. Blocks still live at the end of a trace are freed untimed.
+ */
+typedef enum {
+    TRACE_MALLOC,
+    TRACE_FREE,
+} trace_op_e;
+
+typedef struct trace_op {
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint32_t slot;
+    uint64_t size;
+} trace_op;
+
+typedef struct trace_slot_map trace_slot_map;
+
+typedef struct trace {
+    trace_op* ops;
+    size_t count;
+    size_t capacity;
+    uint32_t slots;
+    trace_slot_map* recorder;
+} trace;
+
+/*
+ * An allocator under test. init resets it to an empty heap before each replay
+ * and may be NULL.
+ */
+typedef struct bench_allocator {
+    const char* name;
+    alloc_strat_e strat;
+    void (*init)(alloc_strat_e strat);
+    void* (*malloc)(size_t size);
+    void (*free)(void* ptr);
+} bench_allocator;
+
+typedef struct bench_result {
+    size_t ops;
+    double ops_per_sec;
+    double p50_ns;
+    double p99_ns;
+    double p999_ns;
+    long peak_rss_kb;
+} bench_result;
+
+/**
+ * Generates a trace of `count` operations over `slots` slots. A random slot is
+ * freed if it is in use and filled otherwise, with sizes uniform in [min_size, max_size].
+ */
+void trace_uniform(trace* t, size_t count, uint32_t slots, size_t min_size, size_t max_size, unsigned seed);
+
+/**
+ * Like trace_uniform, but with Pareto-distributed sizes of shape `alpha`: mostly
+ * small blocks with a heavy tail of large ones, capped at max_size.
+ */
+void trace_power_law(trace* t, size_t count, uint32_t slots, size_t min_size, size_t max_size, double alpha, unsigned seed);
+
+/**
+ * Generates a producer/consumer trace: bursts of allocations queued in FIFO
+ * order, each followed by a burst that frees the oldest blocks, so the queue
+ * depth (at most `slots`) drifts up and down.
+ */
+void trace_producer_consumer(trace* t, size_t count, uint32_t slots, size_t min_size, size_t max_size, unsigned seed);
+
+/**
+ * Records an allocation made by a running program into a trace.
+ *
+ * @param t The trace to append to. Zero-initialize it before the first call.
+ * @param ptr The pointer returned by the allocator.
+ * @param size The requested size.
+ */
+void trace_record_malloc(trace* t, void* ptr, size_t size);
+
+/**
+ * Records the release of a pointer previously passed to trace_record_malloc. Unknown pointers are ignored.
+ */
+void trace_record_free(trace* t, void* ptr);
+
+/**
+ * Writes a trace in the binary trace format: the magic "TDMMTRC1", the
+ * operation and slot counts as 64-bit integers, then one 16-byte trace_op per
+ * operation, all in host byte order.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int trace_save(const trace* t, const char* path);
+
+/**
+ * Reads a trace written by trace_save.
+ *
+ * @return 0 on success, -1 if the file can't be read or isn't a trace.
+ */
+int trace_load(trace* t, const char* path);
+
+void trace_destroy(trace* t);
+
+/**
+ * Replays a trace against an allocator in a child process, so each run starts
+ * from a fresh address space and its peak RSS can be read with wait4. The
+ * trace is replayed twice: once untimed per operation for throughput, then
+ * timing every operation for the latency percentiles.
+ *
+ * @return 0 on success, -1 if the child could not run.
+ */
+int bench_replay(const trace* t, const bench_allocator* alloc, bench_result* result);
+
+/**
+ * Times malloc and free of one size `samples` times on a heap fragmented by
+ * replaying `background` first, and reports the medians in nanoseconds.
+ */
+void bench_size_latency(const trace* background, const bench_allocator* alloc, size_t size, int samples,
+                        double* malloc_ns, double* free_ns);
+
+/**
+ * Replays every workload against every allocator and writes one CSV row per pair:
+ * Workload,Allocator,Ops,OpsPerSec,P50(ns),P99(ns),P999(ns),PeakRSS(KB).
+ */
+void bench_run_all(const trace* workloads, const char* const* workload_names, int workload_count,
+                   const bench_allocator* allocators, int allocator_count, FILE* csv);
+
+#endif // BENCH_H
@@ -137,5 +137,86 @@ def main():
         except Exception:
             pass
 
+    # =========================================================================
+    # GRAPH 5: Multi-threaded Throughput Scaling
+    # =========================================================================
+    scaling_filename = 'thread_scaling.csv'
+    if os.path.exists(scaling_filename):
+        df_scale = pd.read_csv(scaling_filename)
+
+        fig, ax = plt.subplots(figsize=(10, 6))
+        for policy in policies:
+            df = df_scale[df_scale['Policy'] == policy]
+            if not df.empty:
+                ax.plot(df['Threads'], df['OpsPerSec'], marker='o', markersize=4,
+                        label=policy.replace('_', ' '), color=colors[policy])
+
+        ax.set_xlabel('Threads')
+        ax.set_ylabel('Throughput (ops/sec)')
+        ax.set_title('t_malloc()/t_free() Throughput vs. Thread Count')
+        ax.legend()
+        ax.grid(True, alpha=0.5)
+
+        plt.tight_layout()
+        plt.savefig('thread_scaling.png')
+        plt.clf()
+        plt.close()
+
+    # =========================================================================
+    # GRAPH 6: Trace Replay Throughput, Tail Latency and Peak RSS
+    # =========================================================================
+    trace_filename = 'trace_benchmarks.csv'
+    if os.path.exists(trace_filename):
+        df_trace = pd.read_csv(trace_filename)
+        workloads = list(dict.fromkeys(df_trace['Workload']))
+        allocators = list(dict.fromkeys(df_trace['Allocator']))
+        width = 0.8 / len(allocators)
+
+        fig, axes = plt.subplots(1, 3, figsize=(18, 6))
+        metrics = [('OpsPerSec', 'Throughput (ops/sec)'), ('P99(ns)', 'p99 Latency (ns)'), ('PeakRSS(KB)', 'Peak RSS (KB)')]
+        for ax, (column, label) in zip(axes, metrics):
+            for i, allocator in enumerate(allocators):
+                df = df_trace[df_trace['Allocator'] == allocator].set_index('Workload').reindex(workloads)
+                ax.bar([w + i * width for w in range(len(workloads))], df[column], width,
+                       label=allocator.replace('_', ' '), color=colors.get(allocator, 'gray'), alpha=0.8)
+
+            ax.set_xticks([w + width * (len(allocators) - 1) / 2 for w in range(len(workloads))])
+            ax.set_xticklabels([w.replace('_', ' ') for w in workloads])
+            ax.set_ylabel(label)
+            ax.set_title(f'{label} by Workload')
+            ax.legend()
+            ax.grid(axis='y', linestyle='--', alpha=0.7)
+
+        plt.tight_layout()
+        plt.savefig('trace_benchmarks.png')
+        plt.clf()
+        plt.close()
+
+    # =========================================================================
+    # GRAPH 7: find_free_block Search Length Histogram
+    # =========================================================================
+    search_filename = 'search_length.csv'
+    if os.path.exists(search_filename):
+        df_search = pd.read_csv(search_filename)
+
+        fig, ax = plt.subplots(figsize=(10, 6))
+        for policy in policies:
+            df = df_search[df_search['Policy'] == policy]
+            if not df.empty:
+                ax.plot(df['MinVisited'].astype(str), df['Searches'], marker='o', markersize=4,
+                        label=policy.replace('_', ' '), color=colors[policy])
+
+        ax.set_yscale('log')
+        ax.set_xlabel('Free Blocks or Bins Visited (Bucket Lower Bound)')
+        ax.set_ylabel('Searches [Log Scale]')
+        ax.set_title('find_free_block() Search Length')
+        ax.legend()
+        ax.grid(True, alpha=0.5)
+
+        plt.tight_layout()
+        plt.savefig('search_length.png')
+        plt.clf()
+        plt.close()
+
 if __name__ == "__main__":
     main()
\ No newline at end of file
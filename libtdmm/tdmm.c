@@ -1,141 +1,2188 @@
+#define _GNU_SOURCE
 #include "tdmm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 
 #define IS_FREE(x) ((x)->size & 1)
 #define SET_FREE(x, y) ((x)->size = ((x)->size & ~1ULL) | (y))
 
-#define GET_SIZE(x) ((x)->size & ~1ULL)
-#define SET_SIZE(x, y) ((x)->size = (y) | IS_FREE(x))
+// Set on a free block whose whole interior pages have been handed back to the OS.
+#define RELEASED_BIT 2ULL
+#define IS_RELEASED(x) ((x)->size & RELEASED_BIT)
+
+// Set when the physically preceding block is free, in which case its footer sits right before this header.
+#define PREV_FREE_BIT 4ULL
+#define IS_PREV_FREE(x) ((x)->size & PREV_FREE_BIT)
+
+#define GET_SIZE(x) ((x)->size & ~7ULL)
+#define SET_SIZE(x, y) ((x)->size = (y) | ((x)->size & 7ULL))
+
+/*
+ * A block is an 8-byte header followed by its payload. Free blocks also end in
+ * an 8-byte footer (boundary tag) repeating their size, so both physical
+ * neighbours of any block are found in O(1) without a list of all blocks.
+ *
+ * Headers sit 8 bytes past a 16-byte boundary and payload sizes are 8 more
+ * than a multiple of 16, so every payload is 16-byte aligned. The last 8 bytes
+ * of the heap hold an allocated, zero-sized epilogue header that carries the
+ * PREV_FREE bit of the last block and becomes the header of the next extension.
+ */
+#define ALIGNMENT 16
+#define CACHE_LINE 64
+#define NEXT_BLOCK(x) ((header*)((char*)(x) + sizeof(header) + GET_SIZE(x)))
+#define FOOTER(x) (((size_t*)NEXT_BLOCK(x))[-1])
+#define PREV_BLOCK(x) ((header*)((char*)(x) - ((size_t*)(x))[-1] - sizeof(header)))
+#define EPILOGUE(a) ((header*)((a)->heap_end - sizeof(header)))
+
+#define RELEASE_THRESHOLD_DEFAULT (128 * 1024)
+
+// t_free releases a free block inside the heap at most once per this many release_thresholds freed.
+#define RELEASE_INTERVAL_FACTOR 64
+
+// The heap grows by at least this much, so a run of allocations doesn't pay one mprotect each.
+#define HEAP_GROW_MIN (64 * 1024)
 
-static header* headers_start;
-static header *headers_end;
-static size_t requested_size;
-static size_t total_size;
 static alloc_strat_e strategy;
 static long page_size;
-static size_t data_structure_overhead;
+static size_t release_threshold = RELEASE_THRESHOLD_DEFAULT;
+
+/*
+ * FIRST_FIT keeps free blocks in segregated bins indexed by a two-level bitmap:
+ * the first level splits sizes by power of two and the second level splits each
+ * power-of-two range into BIN_SL_COUNT linear sub-ranges. BEST_FIT and WORST_FIT
+ * keep them in a red-black tree ordered by (size, address). Either way the links
+ * live in the payload of the free block, so they cost no extra overhead.
+ */
+#define BIN_SL_SHIFT 2
+#define BIN_SL_COUNT (1 << BIN_SL_SHIFT)
+#define BIN_FL_COUNT 48
+#define BIN_SCAN_LIMIT 8
+
+typedef struct free_node {
+    header* next_free;
+    header* prev_free;
+} free_node;
+
+typedef struct tree_node {
+    header* left;
+    header* right;
+    header* parent;
+    size_t red;
+} tree_node;
+
+#define FREE_NODE(x) ((free_node*)((char*)(x) + sizeof(header)))
+#define TREE_NODE(x) ((tree_node*)((char*)(x) + sizeof(header)))
+#define MIN_PAYLOAD (sizeof(tree_node) + sizeof(size_t))
+
+/*
+ * Requests of up to SLAB_MAX_SIZE bytes bypass the block list and come from
+ * page-sized slabs that each hold objects of a single size class. A slab starts
+ * on a page boundary, so an object's slab (and its size class) is found by
+ * masking its address; the objects themselves carry no header.
+ */
+#define SLAB_CLASSES 12
+#define SLAB_MAX_SIZE 256
+#define SLAB_COMMIT_PAGES 16
+#define SLAB_EMPTY_KEEP 16
+
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    void* free_list;
+    uint32_t size_class;
+    uint32_t object_size;
+    uint32_t used;
+    uint32_t carved;
+    uint32_t capacity;
+} slab;
+
+// Padding the header to a cache line keeps objects of the 64-byte multiple classes on their own lines.
+#define SLAB_HEADER_SIZE ((sizeof(slab) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+static const uint32_t slab_class_sizes[SLAB_CLASSES] = {16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256};
+
+/*
+ * Each arena owns a contiguous slice of one address-space reservation, so the
+ * arena of any block is found from its address alone: the lower half of the
+ * slice holds the block heap and the upper half holds slabs. Threads are spread
+ * over the arenas round-robin; an arena's lock is only contended by the threads
+ * that share it. Memory freed by a thread of another arena is pushed onto the
+ * owner's lock-free remote_frees stack and released by the owner under its lock.
+ *
+ * The reservation holds only the arenas in use. Each slice is 64 GiB when the
+ * address space allows it; under an RLIMIT_AS cap, or when the mapping fails,
+ * slices are halved down to 4 MiB. A request that no longer fits its arena's
+ * slab or heap half moves on to the heap, then to the large tier.
+ */
+#define MAX_ARENAS 16
+#define ARENA_SHIFT_MAX 36
+#define ARENA_SHIFT_MIN 22
+#define ARENA_SPAN ((size_t)1 << arena_shift)
+#define SLAB_SPAN_OFFSET (ARENA_SPAN / 2)
+
+typedef struct arena {
+    pthread_mutex_t lock;
+    header* headers_start;
+    char* heap_end;
+    char* heap_limit;
+    size_t requested_size;
+    size_t total_size;
+    size_t data_structure_overhead;
+    size_t freed_since_release;
+    header* bins[BIN_FL_COUNT][BIN_SL_COUNT];
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[BIN_FL_COUNT];
+    header* tree_root;
+    slab* partial_slabs[SLAB_CLASSES];
+    slab* empty_slabs;
+    size_t empty_slab_count;
+    slab** released_slabs;
+    size_t released_slab_count;
+    size_t released_slab_capacity;
+    char* slab_end;
+    char* slab_limit;
+    size_t slab_count;
+    void* remote_frees;
+} __attribute__((aligned(CACHE_LINE))) arena;
 
-static void set_block_state(header* block, int is_free, size_t size, header* next, header* prev) {
-    block->size = size | is_free;
-    block->next = next;
-    block->prev = prev;
+/*
+ * Requests of LARGE_THRESHOLD bytes or more get a private mapping each, so
+ * freeing one unmaps it at once and t_realloc can grow it with mremap. These
+ * mappings lie outside the arena reservation, which is how t_free tells them
+ * apart, and are linked on a single list shared by all threads.
+ */
+#define LARGE_THRESHOLD (256 * 1024)
+
+/*
+ * In threaded mode every thread keeps a small LIFO cache of freed slab objects
+ * of its own arena, one list per size class, that it reuses without locking.
+ * The caches are linked on a global list so t_gcollect can empty them. A cache
+ * is dead once its thread's destructor has drained it: frees that run in later
+ * destructors on that thread go straight to the arena.
+ */
+#define TCACHE_DEPTH 32
+
+typedef struct thread_cache {
+    void* entries[SLAB_CLASSES];
+    int counts[SLAB_CLASSES];
+    arena* owner;
+    unsigned generation;
+    bool linked;
+    bool dead;
+    struct thread_cache* next;
+    struct thread_cache* prev;
+} thread_cache;
+
+static char* heap_base;
+static int arena_shift;
+static int reserved_arenas;
+static size_t reserved_bytes;
+static arena arenas[MAX_ARENAS];
+static int num_arenas;
+static bool threaded;
+static unsigned next_arena;
+static unsigned heap_generation;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static thread_cache* tcaches;
+static pthread_mutex_t tcache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// map_offset is the distance from the start of the mapping, which is only non-zero for over-aligned blocks.
+typedef struct large_block {
+    struct large_block* next;
+    struct large_block* prev;
+    size_t map_offset;
+    header hdr;
+} large_block;
+
+#define LARGE_BLOCK(x) ((large_block*)((char*)(x) - offsetof(large_block, hdr)))
+
+static char* large_map_start(large_block* block) { return (char*)block - block->map_offset; }
+static size_t large_map_size(large_block* block) { return block->map_offset + sizeof(large_block) + GET_SIZE(&block->hdr); }
+
+static large_block* large_blocks;
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t large_requested_size;
+static size_t large_total_size;
+static size_t large_overhead;
+
+static __thread thread_cache tcache;
+
+static int msb_index(uint64_t x) { return 63 - __builtin_clzll(x); }
+static int lsb_index(uint64_t x) { return __builtin_ctzll(x); }
+
+/*
+ * Statistics counters live in a per-thread block that only its thread writes,
+ * so counting takes no lock and no atomic read-modify-write. t_get_stats sums
+ * the blocks of all live threads with those of exited ones, folded into
+ * retired_stats when a thread ends.
+ */
+typedef struct thread_stats {
+    uint64_t alloc_count[TDMM_SIZE_CLASSES];
+    uint64_t free_count[TDMM_SIZE_CLASSES];
+    uint64_t search_length[TDMM_SEARCH_BUCKETS];
+    bool linked;
+    struct thread_stats* next;
+    struct thread_stats* prev;
+} thread_stats;
+
+static bool stats_enabled;
+static __thread thread_stats tstats;
+static thread_stats* tstats_list;
+static thread_stats retired_stats;
+static pthread_mutex_t tstats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tstats_key;
+static pthread_once_t tstats_key_once = PTHREAD_ONCE_INIT;
+
+static void tstats_destroy(void* unused) {
+    (void)unused;
+    pthread_mutex_lock(&tstats_lock);
+    for(int c = 0; c < TDMM_SIZE_CLASSES; c++) {
+        retired_stats.alloc_count[c] += tstats.alloc_count[c];
+        retired_stats.free_count[c] += tstats.free_count[c];
+    }
+    for(int b = 0; b < TDMM_SEARCH_BUCKETS; b++) retired_stats.search_length[b] += tstats.search_length[b];
+
+    if(tstats.prev) tstats.prev->next = tstats.next;
+    else tstats_list = tstats.next;
+    if(tstats.next) tstats.next->prev = tstats.prev;
+    pthread_mutex_unlock(&tstats_lock);
 }
 
-static header* find_free_block(size_t size) {
-    header* current = headers_start;
-    header* rslt = NULL;
+static void tstats_key_create(void) {
+    pthread_key_create(&tstats_key, tstats_destroy);
+}
+
+static thread_stats* current_stats(void) {
+    if(!tstats.linked) {
+        pthread_once(&tstats_key_once, tstats_key_create);
+        pthread_setspecific(tstats_key, &tstats);
+
+        pthread_mutex_lock(&tstats_lock);
+        tstats.prev = NULL;
+        tstats.next = tstats_list;
+        if(tstats_list) tstats_list->prev = &tstats;
+        tstats_list = &tstats;
+        tstats.linked = true;
+        pthread_mutex_unlock(&tstats_lock);
+    }
+    return &tstats;
+}
+
+// Only this thread writes the counter; the relaxed store just keeps concurrent readers well-defined.
+static void stat_bump(uint64_t* counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static int stat_size_class(size_t size) {
+    int c = size <= 1 ? 0 : msb_index(size - 1) + 1;
+    return c < TDMM_SIZE_CLASSES ? c : TDMM_SIZE_CLASSES - 1;
+}
+
+// Constant false when the counters are compiled out, so every counting site folds away.
+static bool counting(void) {
+#ifdef TDMM_STATS
+    return stats_enabled;
+#else
+    return false;
+#endif
+}
+
+static void stat_alloc(size_t size) {
+    if(counting()) stat_bump(&current_stats()->alloc_count[stat_size_class(size)]);
+}
+
+static void stat_free(size_t size) {
+    if(counting()) stat_bump(&current_stats()->free_count[stat_size_class(size)]);
+}
+
+static void stat_search(size_t steps) {
+    if(!counting()) return;
+    int b = steps == 0 ? 0 : msb_index(steps) + 1;
+    stat_bump(&current_stats()->search_length[b < TDMM_SEARCH_BUCKETS ? b : TDMM_SEARCH_BUCKETS - 1]);
+}
+
+static void bin_index(size_t size, int* fl, int* sl) {
+    int f = msb_index(size);
+    *fl = f;
+    *sl = (int)(size >> (f - BIN_SL_SHIFT)) & (BIN_SL_COUNT - 1);
+}
+
+static void bin_insert(arena* a, header* block) {
+    int fl, sl;
+    bin_index(GET_SIZE(block), &fl, &sl);
+
+    free_node* node = FREE_NODE(block);
+    node->next_free = a->bins[fl][sl];
+    node->prev_free = NULL;
+    if(a->bins[fl][sl]) FREE_NODE(a->bins[fl][sl])->prev_free = block;
+    a->bins[fl][sl] = block;
+
+    a->fl_bitmap |= 1ULL << fl;
+    a->sl_bitmap[fl] |= 1U << sl;
+}
+
+static void bin_remove(arena* a, header* block) {
+    int fl, sl;
+    bin_index(GET_SIZE(block), &fl, &sl);
+
+    free_node* node = FREE_NODE(block);
+    if(node->prev_free) FREE_NODE(node->prev_free)->next_free = node->next_free;
+    else a->bins[fl][sl] = node->next_free;
+    if(node->next_free) FREE_NODE(node->next_free)->prev_free = node->prev_free;
+
+    if(a->bins[fl][sl] == NULL) {
+        a->sl_bitmap[fl] &= ~(1U << sl);
+        if(a->sl_bitmap[fl] == 0) a->fl_bitmap &= ~(1ULL << fl);
+    }
+}
+
+// Returns the first non-empty bin at or after (fl, sl), or false if there is none.
+static bool next_nonempty_bin(arena* a, int* fl, int* sl) {
+    if(*fl >= BIN_FL_COUNT) return false;
+
+    uint32_t sl_map = *sl < BIN_SL_COUNT ? a->sl_bitmap[*fl] & (~0U << *sl) : 0;
+    if(sl_map == 0) {
+        uint64_t fl_map = *fl + 1 < BIN_FL_COUNT ? a->fl_bitmap & (~0ULL << (*fl + 1)) : 0;
+        if(fl_map == 0) return false;
+        *fl = lsb_index(fl_map);
+        sl_map = a->sl_bitmap[*fl];
+    }
+    *sl = lsb_index(sl_map);
+    return true;
+}
+
+// Walks at most BIN_SCAN_LIMIT blocks of a single bin for the first one that fits.
+static header* scan_bin(header* current, size_t size, size_t* steps) {
+    for(int i = 0; current != NULL && i < BIN_SCAN_LIMIT; i++) {
+        (*steps)++;
+        if(GET_SIZE(current) >= size) return current;
+        current = FREE_NODE(current)->next_free;
+    }
+    return NULL;
+}
+
+static header* bin_find(arena* a, size_t size, size_t* steps) {
+    int fl, sl;
+    bin_index(size, &fl, &sl);
+
+    /*
+     * The bin holding `size` may also hold smaller blocks, so only a few of them
+     * are tried. Every block in a later bin fits, so its head is taken as is,
+     * which keeps the search O(1) however many small blocks share the bin.
+     */
+    if(a->bins[fl][sl]) {
+        header* rslt = scan_bin(a->bins[fl][sl], size, steps);
+        if(rslt) return rslt;
+    }
+
+    sl++;
+    if(!next_nonempty_bin(a, &fl, &sl)) return NULL;
+    (*steps)++;
+    return a->bins[fl][sl];
+}
+
+static bool tree_less(header* a, header* b) {
+    size_t sa = GET_SIZE(a), sb = GET_SIZE(b);
+    return sa < sb || (sa == sb && a < b);
+}
+
+static bool is_red(header* node) { return node && TREE_NODE(node)->red; }
+
+// Points whatever referenced `old` (its parent or the root) at `new_node` instead.
+static void tree_replace_child(arena* a, header* old, header* new_node) {
+    header* parent = TREE_NODE(old)->parent;
+    if(parent == NULL) a->tree_root = new_node;
+    else if(TREE_NODE(parent)->left == old) TREE_NODE(parent)->left = new_node;
+    else TREE_NODE(parent)->right = new_node;
+    if(new_node) TREE_NODE(new_node)->parent = parent;
+}
+
+static void tree_rotate_left(arena* a, header* x) {
+    header* y = TREE_NODE(x)->right;
+    TREE_NODE(x)->right = TREE_NODE(y)->left;
+    if(TREE_NODE(y)->left) TREE_NODE(TREE_NODE(y)->left)->parent = x;
+    tree_replace_child(a, x, y);
+    TREE_NODE(y)->left = x;
+    TREE_NODE(x)->parent = y;
+}
+
+static void tree_rotate_right(arena* a, header* x) {
+    header* y = TREE_NODE(x)->left;
+    TREE_NODE(x)->left = TREE_NODE(y)->right;
+    if(TREE_NODE(y)->right) TREE_NODE(TREE_NODE(y)->right)->parent = x;
+    tree_replace_child(a, x, y);
+    TREE_NODE(y)->right = x;
+    TREE_NODE(x)->parent = y;
+}
 
+static void tree_insert(arena* a, header* block) {
+    header* parent = NULL;
+    header* current = a->tree_root;
     while(current != NULL) {
-        size_t s = GET_SIZE(current);
-        if(IS_FREE(current) && s >= size) {
-            if(strategy == FIRST_FIT) {
-                return current;
-            } else if(strategy == BEST_FIT) {
-                if(rslt == NULL || s < GET_SIZE(rslt)) rslt = current;
-            } else if(strategy == WORST_FIT) {
-                if(rslt == NULL || s > GET_SIZE(rslt)) rslt = current;
+        parent = current;
+        current = tree_less(block, current) ? TREE_NODE(current)->left : TREE_NODE(current)->right;
+    }
+
+    tree_node* node = TREE_NODE(block);
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = parent;
+    node->red = true;
+    if(parent == NULL) a->tree_root = block;
+    else if(tree_less(block, parent)) TREE_NODE(parent)->left = block;
+    else TREE_NODE(parent)->right = block;
+
+    header* z = block;
+    while(is_red(TREE_NODE(z)->parent)) {
+        header* p = TREE_NODE(z)->parent;
+        header* g = TREE_NODE(p)->parent;
+        if(p == TREE_NODE(g)->left) {
+            header* uncle = TREE_NODE(g)->right;
+            if(is_red(uncle)) {
+                TREE_NODE(p)->red = TREE_NODE(uncle)->red = false;
+                TREE_NODE(g)->red = true;
+                z = g;
+                continue;
+            }
+            if(z == TREE_NODE(p)->right) {
+                tree_rotate_left(a, p);
+                p = z;
+            }
+            tree_rotate_right(a, g);
+        } else {
+            header* uncle = TREE_NODE(g)->left;
+            if(is_red(uncle)) {
+                TREE_NODE(p)->red = TREE_NODE(uncle)->red = false;
+                TREE_NODE(g)->red = true;
+                z = g;
+                continue;
+            }
+            if(z == TREE_NODE(p)->left) {
+                tree_rotate_right(a, p);
+                p = z;
+            }
+            tree_rotate_left(a, g);
+        }
+        TREE_NODE(p)->red = false;
+        TREE_NODE(g)->red = true;
+        break;
+    }
+    TREE_NODE(a->tree_root)->red = false;
+}
+
+// Restores the black height after a black node was unlinked above `x` (which may be NULL).
+static void tree_remove_fixup(arena* a, header* x, header* parent) {
+    while(x != a->tree_root && !is_red(x)) {
+        if(x == TREE_NODE(parent)->left) {
+            header* w = TREE_NODE(parent)->right;
+            if(is_red(w)) {
+                TREE_NODE(w)->red = false;
+                TREE_NODE(parent)->red = true;
+                tree_rotate_left(a, parent);
+                w = TREE_NODE(parent)->right;
+            }
+            if(!is_red(TREE_NODE(w)->left) && !is_red(TREE_NODE(w)->right)) {
+                TREE_NODE(w)->red = true;
+                x = parent;
+                parent = TREE_NODE(x)->parent;
+                continue;
+            }
+            if(!is_red(TREE_NODE(w)->right)) {
+                TREE_NODE(TREE_NODE(w)->left)->red = false;
+                TREE_NODE(w)->red = true;
+                tree_rotate_right(a, w);
+                w = TREE_NODE(parent)->right;
+            }
+            TREE_NODE(w)->red = TREE_NODE(parent)->red;
+            TREE_NODE(parent)->red = false;
+            TREE_NODE(TREE_NODE(w)->right)->red = false;
+            tree_rotate_left(a, parent);
+        } else {
+            header* w = TREE_NODE(parent)->left;
+            if(is_red(w)) {
+                TREE_NODE(w)->red = false;
+                TREE_NODE(parent)->red = true;
+                tree_rotate_right(a, parent);
+                w = TREE_NODE(parent)->left;
+            }
+            if(!is_red(TREE_NODE(w)->left) && !is_red(TREE_NODE(w)->right)) {
+                TREE_NODE(w)->red = true;
+                x = parent;
+                parent = TREE_NODE(x)->parent;
+                continue;
+            }
+            if(!is_red(TREE_NODE(w)->left)) {
+                TREE_NODE(TREE_NODE(w)->right)->red = false;
+                TREE_NODE(w)->red = true;
+                tree_rotate_left(a, w);
+                w = TREE_NODE(parent)->left;
             }
+            TREE_NODE(w)->red = TREE_NODE(parent)->red;
+            TREE_NODE(parent)->red = false;
+            TREE_NODE(TREE_NODE(w)->left)->red = false;
+            tree_rotate_right(a, parent);
         }
-        current = current->next;
+        x = a->tree_root;
     }
+    if(x) TREE_NODE(x)->red = false;
+}
+
+static void tree_remove(arena* a, header* block) {
+    tree_node* node = TREE_NODE(block);
+    header* x;
+    header* x_parent;
+    bool removed_red;
+
+    if(node->left == NULL || node->right == NULL) {
+        x = node->left ? node->left : node->right;
+        x_parent = node->parent;
+        removed_red = node->red;
+        tree_replace_child(a, block, x);
+    } else {
+        header* succ = node->right;
+        while(TREE_NODE(succ)->left) succ = TREE_NODE(succ)->left;
+
+        tree_node* sn = TREE_NODE(succ);
+        x = sn->right;
+        removed_red = sn->red;
+        if(sn->parent == block) {
+            x_parent = succ;
+        } else {
+            x_parent = sn->parent;
+            tree_replace_child(a, succ, x);
+            sn->right = node->right;
+            TREE_NODE(sn->right)->parent = succ;
+        }
+        tree_replace_child(a, block, succ);
+        sn->left = node->left;
+        TREE_NODE(sn->left)->parent = succ;
+        sn->red = node->red;
+    }
+
+    if(!removed_red) tree_remove_fixup(a, x, x_parent);
+}
 
+// Smallest block of at least `size` bytes, lowest address first among equals.
+static header* tree_lower_bound(arena* a, size_t size, size_t* steps) {
+    header* current = a->tree_root;
+    header* rslt = NULL;
+    while(current != NULL) {
+        (*steps)++;
+        if(GET_SIZE(current) >= size) {
+            rslt = current;
+            current = TREE_NODE(current)->left;
+        } else {
+            current = TREE_NODE(current)->right;
+        }
+    }
     return rslt;
 }
 
-void t_init(alloc_strat_e strat) {
+static header* tree_max(arena* a, size_t* steps) {
+    header* current = a->tree_root;
+    if(current) (*steps)++;
+    while(current && TREE_NODE(current)->right) {
+        current = TREE_NODE(current)->right;
+        (*steps)++;
+    }
+    return current;
+}
+
+static void free_insert(arena* a, header* block) {
+    if(strategy == FIRST_FIT) bin_insert(a, block);
+    else tree_insert(a, block);
+}
+
+static void free_remove(arena* a, header* block) {
+    if(strategy == FIRST_FIT) bin_remove(a, block);
+    else tree_remove(a, block);
+}
+
+static header* find_free_block(arena* a, size_t size) {
+    size_t steps = 0;
+    header* rslt;
+    if(strategy == FIRST_FIT) {
+        rslt = bin_find(a, size, &steps);
+    } else if(strategy == BEST_FIT) {
+        rslt = tree_lower_bound(a, size, &steps);
+    } else {
+        rslt = tree_max(a, &steps);
+        if(rslt && GET_SIZE(rslt) < size) rslt = NULL;
+    }
+
+    stat_search(steps);
+    return rslt;
+}
+
+static void arena_lock(arena* a) { if(threaded) pthread_mutex_lock(&a->lock); }
+static void arena_unlock(arena* a) { if(threaded) pthread_mutex_unlock(&a->lock); }
+
+static arena* arena_of(void* ptr) {
+    return &arenas[(size_t)((char*)ptr - heap_base) >> arena_shift];
+}
+
+static bool in_slab_span(void* ptr) {
+    return ((size_t)((char*)ptr - heap_base) & (ARENA_SPAN - 1)) >= SLAB_SPAN_OFFSET;
+}
+
+static bool is_large(void* ptr) {
+    return (uintptr_t)((char*)ptr - heap_base) >= reserved_bytes;
+}
+
+static char* page_align_up(char* p) { return (char*)(((uintptr_t)p + page_size - 1) & ~(uintptr_t)(page_size - 1)); }
+static char* page_align_down(char* p) { return (char*)((uintptr_t)p & ~(uintptr_t)(page_size - 1)); }
+
+// Returns pages to the OS while keeping them reserved, so the heap stays contiguous.
+static void decommit(char* addr, size_t len) {
+    if(len == 0) return;
+    mmap(addr, len, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+// Grows an array that lives in its own mapping, for bookkeeping that can't come from the heap. Returns NULL on failure.
+static void* grow_mapping(void* old, size_t old_bytes, size_t new_bytes) {
+    void* grown = old_bytes ? mremap(old, old_bytes, new_bytes, MREMAP_MAYMOVE)
+                            : mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    return grown == MAP_FAILED ? NULL : grown;
+}
+
+// The whole pages of a free block between its free-list node and its footer, which can be dropped while it is free.
+static size_t released_range(header* block, char** lo, char** hi) {
+    char* payload = (char*)block + sizeof(header);
+    *lo = page_align_up(payload + sizeof(tree_node));
+    *hi = page_align_down(payload + GET_SIZE(block) - sizeof(size_t));
+    return *hi > *lo ? (size_t)(*hi - *lo) : 0;
+}
+
+static void release_block(arena* a, header* block) {
+    char *lo, *hi;
+    if(IS_RELEASED(block)) return;
+
+    size_t len = released_range(block, &lo, &hi);
+    if(len == 0) return;
+
+    madvise(lo, len, MADV_DONTNEED);
+    block->size |= RELEASED_BIT;
+    a->total_size -= len;
+}
+
+// Counts a released block's pages as committed again; they fault back in zeroed on first touch.
+static void unrelease_block(arena* a, header* block) {
+    char *lo, *hi;
+    if(!IS_RELEASED(block)) return;
+
+    a->total_size += released_range(block, &lo, &hi);
+    block->size &= ~RELEASED_BIT;
+}
+
+// Marks a block released whose range is known to be untouched since it was last released.
+static void mark_released(arena* a, header* block) {
+    char *lo, *hi;
+    size_t len = released_range(block, &lo, &hi);
+    if(len == 0) return;
+
+    block->size |= RELEASED_BIT;
+    a->total_size -= len;
+}
+
+// Writes a block's header (and footer if free) and updates the PREV_FREE bit of its successor.
+static void set_block_state(header* block, int is_free, size_t size, bool prev_free) {
+    block->size = size | is_free | (prev_free ? PREV_FREE_BIT : 0);
+    if(is_free) FOOTER(block) = size;
+
+    // The next block may be in use, and its owner reads its size without the arena lock.
+    header* next = NEXT_BLOCK(block);
+    if(is_free) __atomic_fetch_or(&next->size, PREV_FREE_BIT, __ATOMIC_RELAXED);
+    else __atomic_fetch_and(&next->size, ~PREV_FREE_BIT, __ATOMIC_RELAXED);
+}
+
+// How much to grow the heap by to gain `needed` bytes: whole pages, and HEAP_GROW_MIN where the arena has room.
+static size_t heap_grow_size(arena* a, size_t needed) {
+    size_t size = (needed + page_size - 1) & ~(page_size - 1);
+    size_t room = a->heap_limit - a->heap_end;
+    size_t step = HEAP_GROW_MIN < room ? HEAP_GROW_MIN : room;
+    return size > step ? size : step;
+}
+
+/*
+ * Commits `allocation_size` more bytes at the end of the arena's heap and returns
+ * them as one free block, or NULL with errno set to ENOMEM if the heap is full.
+ */
+static header* arena_grow(arena* a, size_t allocation_size) {
+    if(allocation_size > (size_t)(a->heap_limit - a->heap_end) ||
+       mprotect(a->heap_end, allocation_size, PROT_READ | PROT_WRITE) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // The old epilogue becomes the new block's header.
+    header* new_block = EPILOGUE(a);
+    bool prev_free = IS_PREV_FREE(new_block);
+    a->heap_end += allocation_size;
+    EPILOGUE(a)->size = 0;
+    set_block_state(new_block, true, allocation_size - sizeof(header), prev_free);
+    free_insert(a, new_block);
+
+    a->total_size += allocation_size;
+    a->data_structure_overhead += sizeof(header);
+    return new_block;
+}
+
+static bool arena_init(arena* a, char* base) {
+    a->headers_start = (header*)(base + ALIGNMENT - sizeof(header));
+    a->heap_limit = base + SLAB_SPAN_OFFSET;
+    a->requested_size = 0;
+
+    memset(a->bins, 0, sizeof(a->bins));
+    memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+    a->fl_bitmap = 0;
+    a->tree_root = NULL;
+    memset(a->partial_slabs, 0, sizeof(a->partial_slabs));
+    a->empty_slabs = NULL;
+    a->empty_slab_count = 0;
+    a->released_slabs = NULL;
+    a->released_slab_count = 0;
+    a->released_slab_capacity = 0;
+    a->slab_end = base + SLAB_SPAN_OFFSET;
+    a->slab_limit = base + ARENA_SPAN;
+    a->slab_count = 0;
+    a->remote_frees = NULL;
+    a->freed_since_release = 0;
+
+    // The heap starts with 8 bytes of padding, then one free block and the epilogue filling the first page.
+    a->heap_end = base;
+    if(mprotect(base, page_size, PROT_READ | PROT_WRITE) != 0) return false;
+    a->heap_end = base + page_size;
+    EPILOGUE(a)->size = 0;
+    set_block_state(a->headers_start, true, page_size - ALIGNMENT - sizeof(header), false);
+    free_insert(a, a->headers_start);
+
+    a->total_size = page_size;
+    a->data_structure_overhead = ALIGNMENT + sizeof(header);
+    return true;
+}
+
+// Hands everything an arena committed back to the OS.
+static void arena_teardown(arena* a, char* base) {
+    decommit(base, a->heap_end - base);
+    decommit(base + SLAB_SPAN_OFFSET, a->slab_end - (base + SLAB_SPAN_OFFSET));
+    if(a->released_slabs) munmap(a->released_slabs, a->released_slab_capacity * sizeof(slab*));
+}
+
+// Clears the counters of every thread. Like t_init, this must not race with allocations.
+static void reset_stats(void) {
+    pthread_mutex_lock(&tstats_lock);
+    for(thread_stats* stats = tstats_list; stats != NULL; stats = stats->next) {
+        memset(stats->alloc_count, 0, sizeof(stats->alloc_count));
+        memset(stats->free_count, 0, sizeof(stats->free_count));
+        memset(stats->search_length, 0, sizeof(stats->search_length));
+    }
+    memset(&retired_stats, 0, sizeof(retired_stats));
+    pthread_mutex_unlock(&tstats_lock);
+}
+
+/*
+ * Reserves address space for `arena_count` arenas, with the largest slice that
+ * both fits a quarter of any RLIMIT_AS cap and can actually be mapped. The rest
+ * of a capped address space is left to large blocks and the program itself.
+ */
+static bool reserve_heap(int arena_count) {
+    int shift = ARENA_SHIFT_MAX;
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_AS, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        while(shift > ARENA_SHIFT_MIN && ((rlim_t)arena_count << shift) > limit.rlim_cur / 4) shift--;
+    }
+
+    for(; shift >= ARENA_SHIFT_MIN; shift--) {
+        size_t bytes = (size_t)arena_count << shift;
+        void* reservation = mmap(NULL, bytes, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if(reservation == MAP_FAILED) continue;
+
+        heap_base = reservation;
+        arena_shift = shift;
+        reserved_arenas = arena_count;
+        reserved_bytes = bytes;
+        for(int i = 0; i < arena_count; i++) pthread_mutex_init(&arenas[i].lock, NULL);
+        return true;
+    }
+    return false;
+}
+
+// Leaves the allocator without arenas, so that every allocation fails, if the heap can't be set up.
+static void init_heap(alloc_strat_e strat, int arena_count, bool is_threaded) {
 	strategy = strat;
 	page_size = sysconf(_SC_PAGESIZE);
-	header* initial_block = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    
-    if(initial_block == MAP_FAILED) {
-        fprintf(stderr, "Error: failed to initialize allocator\n");
-        exit(0);
+
+    if(arena_count < 1) arena_count = 1;
+    if(arena_count > MAX_ARENAS) arena_count = MAX_ARENAS;
+
+    if(heap_base != NULL) {
+        for(int i = 0; i < num_arenas; i++) arena_teardown(&arenas[i], heap_base + i * ARENA_SPAN);
+        while(large_blocks) {
+            large_block* next = large_blocks->next;
+            munmap(large_map_start(large_blocks), large_map_size(large_blocks));
+            large_blocks = next;
+        }
+    }
+    large_requested_size = 0;
+    large_total_size = 0;
+    large_overhead = 0;
+    reset_stats();
+    num_arenas = 0;
+
+    // A reservation too small for the new arena count is replaced; nothing in it is live any more.
+    if(heap_base != NULL && arena_count > reserved_arenas) {
+        munmap(heap_base, reserved_bytes);
+        heap_base = NULL;
+        reserved_bytes = 0;
+        reserved_arenas = 0;
+    }
+    if(heap_base == NULL && !reserve_heap(arena_count)) return;
+
+    threaded = is_threaded;
+    num_arenas = arena_count;
+    next_arena = 0;
+    heap_generation++;
+
+    for(int i = 0; i < arena_count; i++) {
+        if(!arena_init(&arenas[i], heap_base + i * ARENA_SPAN)) {
+            for(int j = 0; j <= i; j++) arena_teardown(&arenas[j], heap_base + j * ARENA_SPAN);
+            num_arenas = 0;
+            return;
+        }
     }
-    
-    set_block_state(initial_block, true, page_size - sizeof(header), NULL, NULL);
-    
-    headers_start = initial_block;
-    headers_end = initial_block;
-    requested_size = 0;
-    total_size = page_size;
-    data_structure_overhead = sizeof(header);
 }
 
-void *t_malloc(size_t size) {
-    if(size == 0) return NULL;
-    
-    size_t aligned_size = (size + 3) & ~3;
-    
-    header* block = find_free_block(aligned_size);
+void t_init(alloc_strat_e strat) {
+    init_heap(strat, 1, false);
+}
+
+void t_init_mt(alloc_strat_e strat, int arena_count) {
+    init_heap(strat, arena_count, true);
+}
+
+static header* merge_blocks(arena* a, header* block);
+
+static void *arena_malloc(arena* a, size_t aligned_size) {
+    header* block = find_free_block(a, aligned_size);
     if(block == NULL) {
         size_t size_needed = aligned_size + sizeof(header);
-        size_t allocation_size = (size_needed + page_size - 1) & ~(page_size - 1);
-        void* endptr = (char*)headers_end + sizeof(header) + GET_SIZE(headers_end);
-        header* new_block = mmap(endptr, allocation_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-        
-        if(new_block == MAP_FAILED) {
-            fprintf(stderr, "Error: failed to allocate memory\n");
-            exit(1);
-        }
-        
-        set_block_state(new_block, true, allocation_size - sizeof(header), NULL, headers_end);
-        
-        headers_end->next = new_block;
-        headers_end = new_block;
-        block = new_block;
-        
-        total_size += allocation_size;
-        data_structure_overhead += sizeof(header);
+        header* new_block = arena_grow(a, heap_grow_size(a, size_needed));
+        if(new_block == NULL) return NULL;
+
+        // The heap is contiguous, so a free tail block joins the extension.
+        block = IS_PREV_FREE(new_block) ? merge_blocks(a, PREV_BLOCK(new_block)) : new_block;
     }
     
+    bool released = IS_RELEASED(block);
+    unrelease_block(a, block);
+    free_remove(a, block);
+
     size_t block_size = GET_SIZE(block);
-    if (block_size >= aligned_size + sizeof(header) + 4) {
-        header* new_block = (header*)((char*)block + sizeof(header) + aligned_size);
-        set_block_state(new_block, true, block_size - aligned_size - sizeof(header), block->next, block);
-        
+    if (block_size >= aligned_size + sizeof(header) + MIN_PAYLOAD) {
+        size_t rest_size = block_size - aligned_size - sizeof(header);
         block_size = aligned_size;
-        block->next = new_block;
+        set_block_state(block, false, block_size, false);
+
+        header* new_block = NEXT_BLOCK(block);
+        set_block_state(new_block, true, rest_size, false);
+        free_insert(a, new_block);
+
+        // Only the head of a released block gets touched, so the remainder's own range stays released.
+        if(released) mark_released(a, new_block);
         
-        if(headers_end == block) headers_end = new_block;
-        data_structure_overhead += sizeof(header);
+        a->data_structure_overhead += sizeof(header);
+    } else {
+        set_block_state(block, false, block_size, false);
     }
     
-    block->size = block_size;
-    requested_size += block_size;
+    a->requested_size += block_size;
     return (char*)block + sizeof(header);
 }
 
-static void merge_blocks(header* block){
-    if(!block || !block->next) return;
-    if((char*)block->next != (char*)block + sizeof(header) + GET_SIZE(block)) return;
-    if(!IS_FREE(block) || !IS_FREE(block->next)) return;
-    
-    if(block->next == headers_end) headers_end = block;
+// Joins a free block with its free physical successor. Returns the surviving block, or NULL if nothing merged.
+static header* merge_blocks(arena* a, header* block){
+    if(!IS_FREE(block)) return NULL;
+
+    header* next = NEXT_BLOCK(block);
+    if(!IS_FREE(next)) return NULL;
     
-    block->size += sizeof(header) + GET_SIZE(block->next);
-    block->next = block->next->next;
-    data_structure_overhead -= sizeof(header);
+    char *block_lo, *block_hi, *next_lo, *next_hi;
+    bool block_released = IS_RELEASED(block);
+    bool next_released = IS_RELEASED(next);
+    released_range(block, &block_lo, &block_hi);
+    released_range(next, &next_lo, &next_hi);
+    unrelease_block(a, block);
+    unrelease_block(a, next);
+
+    free_remove(a, block);
+    free_remove(a, next);
+
+    set_block_state(block, true, GET_SIZE(block) + sizeof(header) + GET_SIZE(next), IS_PREV_FREE(block));
+    a->data_structure_overhead -= sizeof(header);
+
+    free_insert(a, block);
+
+    /*
+     * Two released blocks stay released once the page or two between their ranges
+     * is dropped. A merge with only one released side is counted as committed
+     * instead, so freeing next to a released hole costs no system call; arena_free
+     * releases it again in its own time.
+     */
+    if(block_released && next_released) {
+        if(next_lo > block_hi) madvise(block_hi, next_lo - block_hi, MADV_DONTNEED);
+        mark_released(a, block);
+    }
+    return block;
 }
 
-void t_free(void *ptr) {
-   	if(ptr == NULL) return;
-    
-    header* block = (header*)((char*)ptr - sizeof(header));
-    SET_FREE(block, 1);
-    requested_size -= GET_SIZE(block);
+// Gives the free tail of the heap back to the OS, leaving `keep_bytes` of it committed.
+static size_t trim_top(arena* a, size_t keep_bytes) {
+    if(!IS_PREV_FREE(EPILOGUE(a))) return 0;
+    header* tail = PREV_BLOCK(EPILOGUE(a));
+
+    char* payload = (char*)tail + sizeof(header);
+    size_t room = (char*)EPILOGUE(a) - payload - MIN_PAYLOAD;
+    if(keep_bytes >= room) return 0;
+
+    char* new_end = page_align_up(payload + MIN_PAYLOAD + keep_bytes + sizeof(header));
+    if(new_end >= a->heap_end) return 0;
+
+    size_t len = a->heap_end - new_end;
+    bool released = IS_RELEASED(tail);
+    unrelease_block(a, tail);
+    free_remove(a, tail);
+
+    decommit(new_end, len);
+    a->heap_end = new_end;
+    EPILOGUE(a)->size = 0;
+    set_block_state(tail, true, (char*)EPILOGUE(a) - payload, false);
+    a->total_size -= len;
+
+    free_insert(a, tail);
+    if(released) mark_released(a, tail);
+    return len;
+}
+
+static void arena_free(arena* a, header* block) {
+    a->requested_size -= GET_SIZE(block);
+    a->freed_since_release += GET_SIZE(block);
+    set_block_state(block, true, GET_SIZE(block), IS_PREV_FREE(block));
+    free_insert(a, block);
     
-    merge_blocks(block);
-    merge_blocks(block->prev);
+    merge_blocks(a, block);
+    header* merged = IS_PREV_FREE(block) ? merge_blocks(a, PREV_BLOCK(block)) : block;
+
+    if(GET_SIZE(merged) < release_threshold) return;
+
+    /*
+     * Released pages fault back in one by one when reused, so memory is handed
+     * back with some slack: the free tail is cut back to release_threshold once
+     * it reaches twice that, and a hole inside the heap is released at most once
+     * per RELEASE_INTERVAL_FACTOR * release_threshold bytes freed into the arena.
+     */
+    if(NEXT_BLOCK(merged) == EPILOGUE(a)) {
+        if(GET_SIZE(merged) / 2 >= release_threshold) trim_top(a, release_threshold);
+    } else if(a->freed_since_release / RELEASE_INTERVAL_FACTOR >= release_threshold) {
+        release_block(a, merged);
+        a->freed_since_release = 0;
+    }
 }
 
-void t_display_stats() {
-    printf("Total bytes requested from sys: %zu bytes\n", total_size);
-    printf("Data structure overhead: %zu bytes (%.5f%%)\n", data_structure_overhead, (double)data_structure_overhead / total_size * 100);
+static int slab_class_of(size_t size) {
+    static const uint8_t class_index[SLAB_MAX_SIZE / 16 + 1] = {0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11};
+    return class_index[(size + 15) >> 4];
+}
+
+static slab* slab_of(void* ptr) {
+    return (slab*)((uintptr_t)ptr & ~(uintptr_t)(page_size - 1));
+}
+
+static void slab_list_push(slab** list, slab* s) {
+    s->prev = NULL;
+    s->next = *list;
+    if(*list) (*list)->prev = s;
+    *list = s;
+}
+
+static void slab_list_remove(slab** list, slab* s) {
+    if(s->prev) s->prev->next = s->next;
+    else *list = s->next;
+    if(s->next) s->next->prev = s->prev;
+}
+
+static slab* slab_new(arena* a, int size_class) {
+    slab* s = a->empty_slabs;
+    if(s != NULL) {
+        a->empty_slabs = s->next;
+        a->empty_slab_count--;
+    } else if(a->released_slab_count > 0) {
+        s = a->released_slabs[--a->released_slab_count];
+        a->total_size += page_size;
+    } else {
+        // Pages are committed SLAB_COMMIT_PAGES at a time; the spare ones wait on the empty list.
+        size_t commit_size = SLAB_COMMIT_PAGES * page_size;
+        if(commit_size > (size_t)(a->slab_limit - a->slab_end) ||
+           mprotect(a->slab_end, commit_size, PROT_READ | PROT_WRITE) != 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        s = (slab*)a->slab_end;
+        for(int i = SLAB_COMMIT_PAGES - 1; i > 0; i--) {
+            slab* spare = (slab*)(a->slab_end + i * page_size);
+            spare->next = a->empty_slabs;
+            a->empty_slabs = spare;
+            a->empty_slab_count++;
+        }
+        a->slab_end += commit_size;
+        a->total_size += commit_size;
+    }
+
+    s->free_list = NULL;
+    s->size_class = size_class;
+    s->object_size = slab_class_sizes[size_class];
+    s->used = 0;
+    s->carved = 0;
+    s->capacity = (page_size - SLAB_HEADER_SIZE) / s->object_size;
+    slab_list_push(&a->partial_slabs[size_class], s);
+
+    a->slab_count++;
+    a->data_structure_overhead += SLAB_HEADER_SIZE;
+    return s;
 }
 
-size_t t_get_ds_overhead() {return data_structure_overhead;}
-double t_get_usage(){ return (double)requested_size / total_size * 100;}
\ No newline at end of file
+/*
+ * Empty slabs past the first SLAB_EMPTY_KEEP are dropped with madvise. Their
+ * addresses can't live in the dropped page itself, so they are kept in a side
+ * array. That array is its own mapping, so it counts towards both the total size
+ * and the data structure overhead.
+ */
+static bool release_slab(arena* a, slab* s) {
+    if(a->released_slab_count == a->released_slab_capacity) {
+        size_t old_bytes = a->released_slab_capacity * sizeof(slab*);
+        size_t new_bytes = old_bytes ? old_bytes * 2 : (size_t)page_size;
+        void* grown = grow_mapping(a->released_slabs, old_bytes, new_bytes);
+        if(grown == NULL) return false;
+
+        a->released_slabs = grown;
+        a->released_slab_capacity = new_bytes / sizeof(slab*);
+        a->total_size += new_bytes - old_bytes;
+        a->data_structure_overhead += new_bytes - old_bytes;
+    }
+
+    madvise(s, page_size, MADV_DONTNEED);
+    a->released_slabs[a->released_slab_count++] = s;
+    a->total_size -= page_size;
+    return true;
+}
+
+static void* slab_malloc(arena* a, int size_class) {
+    slab* s = a->partial_slabs[size_class];
+    if(s == NULL) s = slab_new(a, size_class);
+    if(s == NULL) return NULL;
+
+    // Objects past `carved` have never been handed out, so a fresh slab needs no free list built up front.
+    void* obj = s->free_list;
+    if(obj != NULL) s->free_list = *(void**)obj;
+    else obj = (char*)s + SLAB_HEADER_SIZE + (size_t)s->carved++ * s->object_size;
+
+    if(++s->used == s->capacity) slab_list_remove(&a->partial_slabs[size_class], s);
+    a->requested_size += s->object_size;
+    return obj;
+}
+
+static void slab_free(arena* a, void* ptr) {
+    slab* s = slab_of(ptr);
+    *(void**)ptr = s->free_list;
+    s->free_list = ptr;
+    a->requested_size -= s->object_size;
+
+    if(s->used-- == s->capacity) slab_list_push(&a->partial_slabs[s->size_class], s);
+    if(s->used == 0) {
+        slab_list_remove(&a->partial_slabs[s->size_class], s);
+        if(a->empty_slab_count < SLAB_EMPTY_KEEP || !release_slab(a, s)) {
+            s->next = a->empty_slabs;
+            a->empty_slabs = s;
+            a->empty_slab_count++;
+        }
+
+        a->slab_count--;
+        a->data_structure_overhead -= SLAB_HEADER_SIZE;
+    }
+}
+
+// Returns memory to the tier it came from. Must hold the arena lock.
+static void arena_release(arena* a, void* ptr) {
+    if(in_slab_span(ptr)) slab_free(a, ptr);
+    else arena_free(a, (header*)((char*)ptr - sizeof(header)));
+}
+
+// Releases the memory other threads handed back to this arena. Must hold the arena lock.
+static void drain_remote_frees(arena* a) {
+    if(__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+
+    void* ptr = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while(ptr != NULL) {
+        void* next = *(void**)ptr;
+        arena_release(a, ptr);
+        ptr = next;
+    }
+}
+
+static void remote_free_push(arena* a, void* ptr) {
+    void* head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void**)ptr = head;
+    } while(!__atomic_compare_exchange_n(&a->remote_frees, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Returns every cached object to its slab. Must hold the owner's arena lock.
+static void tcache_drain(thread_cache* cache) {
+    for(int c = 0; c < SLAB_CLASSES; c++) {
+        void* ptr = cache->entries[c];
+        while(ptr != NULL) {
+            void* next = *(void**)ptr;
+            slab_free(cache->owner, ptr);
+            ptr = next;
+        }
+        cache->entries[c] = NULL;
+        cache->counts[c] = 0;
+    }
+}
+
+static void tcache_destroy(void* unused) {
+    (void)unused;
+    if(tcache.generation == heap_generation) {
+        arena_lock(tcache.owner);
+        tcache_drain(&tcache);
+        arena_unlock(tcache.owner);
+    }
+
+    pthread_mutex_lock(&tcache_list_lock);
+    if(tcache.prev) tcache.prev->next = tcache.next;
+    else tcaches = tcache.next;
+    if(tcache.next) tcache.next->prev = tcache.prev;
+    pthread_mutex_unlock(&tcache_list_lock);
+    tcache.linked = false;
+    tcache.dead = true;
+}
+
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static arena* current_arena(void) {
+    if(!threaded) return &arenas[0];
+
+    if(tcache.generation != heap_generation) {
+        // First call on this thread since t_init: anything cached belongs to the old heap.
+        memset(tcache.entries, 0, sizeof(tcache.entries));
+        memset(tcache.counts, 0, sizeof(tcache.counts));
+        tcache.owner = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % num_arenas];
+        tcache.generation = heap_generation;
+
+        if(!tcache.linked && !tcache.dead) {
+            pthread_once(&tcache_key_once, tcache_key_create);
+            pthread_setspecific(tcache_key, &tcache);
+
+            pthread_mutex_lock(&tcache_list_lock);
+            tcache.prev = NULL;
+            tcache.next = tcaches;
+            if(tcaches) tcaches->prev = &tcache;
+            tcaches = &tcache;
+            tcache.linked = true;
+            pthread_mutex_unlock(&tcache_list_lock);
+        }
+    }
+    return tcache.owner;
+}
+
+static void large_lock_acquire(void) { if(threaded) pthread_mutex_lock(&large_lock); }
+static void large_lock_release(void) { if(threaded) pthread_mutex_unlock(&large_lock); }
+
+static void large_link(large_block* block) {
+    block->prev = NULL;
+    block->next = large_blocks;
+    if(large_blocks) large_blocks->prev = block;
+    large_blocks = block;
+}
+
+static void large_unlink(large_block* block) {
+    if(block->prev) block->prev->next = block->next;
+    else large_blocks = block->next;
+    if(block->next) block->next->prev = block->prev;
+}
+
+// Larger requests would overflow the mapping size; no mapping can be this big anyway.
+#define LARGE_MAX_SIZE (SIZE_MAX / 2)
+
+// The largest power of two that fits in LARGE_MAX_SIZE, and so the largest alignment t_aligned_alloc takes.
+#define LARGE_MAX_ALIGNMENT ((LARGE_MAX_SIZE >> 1) + 1)
+
+static void* large_malloc(size_t size, size_t alignment) {
+    // Over-aligned blocks map `alignment` spare bytes, then unmap the whole pages around the aligned block.
+    size_t slack = alignment > ALIGNMENT ? alignment : 0;
+    if(slack > LARGE_MAX_SIZE || size > LARGE_MAX_SIZE - slack) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t map_size = (size + sizeof(large_block) + slack + page_size - 1) & ~(page_size - 1);
+    char* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(map == MAP_FAILED) return NULL;
+
+    char* payload = (char*)(((uintptr_t)map + sizeof(large_block) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    large_block* block = (large_block*)(payload - sizeof(large_block));
+    if(slack) {
+        char* start = page_align_down((char*)block);
+        char* end = page_align_up(payload + size);
+        if(start > map) munmap(map, start - map);
+        if(map + map_size > end) munmap(end, map + map_size - end);
+        map = start;
+        map_size = end - start;
+    }
+    block->map_offset = (char*)block - map;
+    block->hdr.size = map_size - block->map_offset - sizeof(large_block);
+
+    large_lock_acquire();
+    large_link(block);
+    large_requested_size += GET_SIZE(&block->hdr);
+    large_total_size += map_size;
+    large_overhead += sizeof(large_block) + block->map_offset;
+    large_lock_release();
+    return payload;
+}
+
+// Drops a large block from the list and the counters. Must hold the large lock.
+static void large_forget(large_block* block) {
+    large_unlink(block);
+    large_requested_size -= GET_SIZE(&block->hdr);
+    large_total_size -= large_map_size(block);
+    large_overhead -= sizeof(large_block) + block->map_offset;
+}
+
+static void large_free(large_block* block) {
+    char* map = large_map_start(block);
+    size_t map_size = large_map_size(block);
+
+    large_lock_acquire();
+    large_forget(block);
+    large_lock_release();
+
+    munmap(map, map_size);
+}
+
+// Resizes a large block's mapping, moving it only if the kernel can't grow it in place.
+static void* large_realloc(large_block* block, size_t size) {
+    if(size > LARGE_MAX_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t old_map_size = large_map_size(block);
+    size_t prefix = block->map_offset + sizeof(large_block);
+    size_t map_size = (size + prefix + page_size - 1) & ~(page_size - 1);
+    if(map_size == old_map_size) return (char*)block + sizeof(large_block);
+
+    large_lock_acquire();
+    char* map = mremap(large_map_start(block), old_map_size, map_size, MREMAP_MAYMOVE);
+    if(map == MAP_FAILED) {
+        large_lock_release();
+        return NULL;
+    }
+
+    large_block* moved = (large_block*)(map + prefix - sizeof(large_block));
+    if(moved->prev) moved->prev->next = moved;
+    else large_blocks = moved;
+    if(moved->next) moved->next->prev = moved;
+
+    moved->hdr.size = map_size - prefix;
+    large_requested_size = large_requested_size - (old_map_size - prefix) + GET_SIZE(&moved->hdr);
+    large_total_size = large_total_size - old_map_size + map_size;
+    large_lock_release();
+    return (char*)moved + sizeof(large_block);
+}
+
+/*
+ * Resizes an allocated heap block without moving it: shrinking splits off the
+ * tail, growing absorbs the free physical successor, and a block at the end of
+ * the heap grows the heap first. Must hold the arena lock.
+ */
+static bool arena_resize(arena* a, header* block, size_t aligned_size) {
+    size_t old_size = GET_SIZE(block);
+    header* next = NEXT_BLOCK(block);
+    bool next_released = false;
+
+    if(aligned_size > old_size) {
+        size_t available = old_size;
+        if(IS_FREE(next)) available += sizeof(header) + GET_SIZE(next);
+
+        header* after = IS_FREE(next) ? NEXT_BLOCK(next) : next;
+        if(available < aligned_size && after == EPILOGUE(a)) {
+            header* extension = arena_grow(a, heap_grow_size(a, aligned_size - available + sizeof(header)));
+            if(extension == NULL) return false;
+            if(IS_FREE(next)) merge_blocks(a, next);
+            else next = extension;
+            available = old_size + sizeof(header) + GET_SIZE(next);
+        }
+
+        if(!IS_FREE(next) || available < aligned_size) return false;
+
+        next_released = IS_RELEASED(next);
+        unrelease_block(a, next);
+        free_remove(a, next);
+
+        set_block_state(block, false, available, IS_PREV_FREE(block));
+        a->data_structure_overhead -= sizeof(header);
+    }
+
+    size_t block_size = GET_SIZE(block);
+    if(block_size >= aligned_size + sizeof(header) + MIN_PAYLOAD) {
+        set_block_state(block, false, aligned_size, IS_PREV_FREE(block));
+        header* rest = NEXT_BLOCK(block);
+        set_block_state(rest, true, block_size - aligned_size - sizeof(header), false);
+        a->data_structure_overhead += sizeof(header);
+
+        // The rest lies past everything the caller can have written, so an absorbed released range stays released.
+        free_insert(a, rest);
+        if(next_released) mark_released(a, rest);
+        merge_blocks(a, rest);
+    }
+
+    a->requested_size = a->requested_size - old_size + GET_SIZE(block);
+    return true;
+}
+
+// Payloads are 8 more than a multiple of 16 so the next header keeps payloads 16-byte aligned.
+static size_t heap_payload_size(size_t size) {
+    size_t aligned_size = ((size + sizeof(header) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - sizeof(header);
+    return aligned_size < MIN_PAYLOAD ? MIN_PAYLOAD : aligned_size;
+}
+
+/*
+ * Carves an `alignment`-aligned block out of a larger free one. The slack in
+ * front becomes a free block of its own and the tail is split off, so neither
+ * is wasted. Must hold the arena lock.
+ */
+static void* arena_memalign(arena* a, size_t alignment, size_t aligned_size) {
+    char* payload = arena_malloc(a, aligned_size + alignment + sizeof(header) + MIN_PAYLOAD);
+    if(payload == NULL) return NULL;
+    char* aligned = (char*)(((uintptr_t)payload + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if(aligned != payload && (size_t)(aligned - payload) < sizeof(header) + MIN_PAYLOAD) aligned += alignment;
+
+    header* block = (header*)(payload - sizeof(header));
+    if(aligned != payload) {
+        size_t lead = aligned - payload;
+        header* aligned_block = (header*)(aligned - sizeof(header));
+        set_block_state(aligned_block, false, GET_SIZE(block) - lead, false);
+        set_block_state(block, false, lead - sizeof(header), IS_PREV_FREE(block));
+        a->data_structure_overhead += sizeof(header);
+        a->requested_size -= sizeof(header);
+
+        arena_free(a, block);
+        block = aligned_block;
+    }
+
+    arena_resize(a, block, aligned_size);
+    return aligned;
+}
+
+// Size of the memory behind ptr that the caller may use.
+// Called without the arena lock, while a neighbour may be updating PREV_FREE_BIT in the same header.
+static size_t usable_size(void* ptr) {
+    if(!is_large(ptr) && in_slab_span(ptr)) return slab_of(ptr)->object_size;
+    header* hdr = (header*)((char*)ptr - sizeof(header));
+    return __atomic_load_n(&hdr->size, __ATOMIC_RELAXED) & ~7ULL;
+}
+
+static void* counted(void* ptr) {
+    if(counting() && ptr) stat_alloc(usable_size(ptr));
+    return ptr;
+}
+
+static void* small_malloc(int size_class) {
+    // current_arena comes first: it empties a cache left over from before the last t_init.
+    arena* a = current_arena();
+    if(threaded && tcache.entries[size_class]) {
+        void* ptr = tcache.entries[size_class];
+        tcache.entries[size_class] = *(void**)ptr;
+        tcache.counts[size_class]--;
+        return ptr;
+    }
+
+    arena_lock(a);
+    drain_remote_frees(a);
+    void* ptr = slab_malloc(a, size_class);
+    arena_unlock(a);
+    return ptr;
+}
+
+// Whether t_init has set up a heap. Allocations fail with ENOMEM until it has.
+static bool heap_ready(void) {
+    if(num_arenas > 0) return true;
+    errno = ENOMEM;
+    return false;
+}
+
+void *t_malloc(size_t size) {
+    if(size == 0 || !heap_ready()) return NULL;
+    if(size >= LARGE_THRESHOLD) return counted(large_malloc(size, ALIGNMENT));
+
+    void* ptr = size <= SLAB_MAX_SIZE ? small_malloc(slab_class_of(size)) : NULL;
+    if(ptr == NULL) {
+        arena* a = current_arena();
+        arena_lock(a);
+        drain_remote_frees(a);
+        ptr = arena_malloc(a, heap_payload_size(size));
+        arena_unlock(a);
+    }
+
+    // The arena's slice is full; t_free tells a large block apart by its address alone.
+    if(ptr == NULL) ptr = large_malloc(size, ALIGNMENT);
+    return counted(ptr);
+}
+
+void *t_aligned_alloc(size_t alignment, size_t size) {
+    if(size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0 || !heap_ready()) return NULL;
+    if(alignment <= ALIGNMENT) return t_malloc(size);
+    if(alignment > LARGE_MAX_ALIGNMENT) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if(size >= LARGE_THRESHOLD || alignment >= LARGE_THRESHOLD - size) return counted(large_malloc(size, alignment));
+
+    // Slab objects start a cache line into the slab, so a class that is a multiple of the alignment keeps it.
+    void* ptr = NULL;
+    if(size <= SLAB_MAX_SIZE && alignment <= CACHE_LINE) {
+        int c = slab_class_of(size);
+        while(slab_class_sizes[c] % alignment != 0) c++;
+        ptr = small_malloc(c);
+    }
+
+    if(ptr == NULL) {
+        arena* a = current_arena();
+        arena_lock(a);
+        drain_remote_frees(a);
+        ptr = arena_memalign(a, alignment, heap_payload_size(size));
+        arena_unlock(a);
+    }
+
+    if(ptr == NULL) ptr = large_malloc(size, alignment);
+    return counted(ptr);
+}
+
+void t_free(void *ptr) {
+   	if(ptr == NULL) return;
+    if(counting()) stat_free(usable_size(ptr));
+
+    if(is_large(ptr)) {
+        large_free(LARGE_BLOCK((char*)ptr - sizeof(header)));
+        return;
+    }
+    
+    arena* a = arena_of(ptr);
+
+    if(threaded) {
+        if(a != current_arena()) {
+            remote_free_push(a, ptr);
+            return;
+        }
+
+        if(in_slab_span(ptr) && !tcache.dead) {
+            int c = slab_of(ptr)->size_class;
+            if(tcache.counts[c] < TCACHE_DEPTH) {
+                *(void**)ptr = tcache.entries[c];
+                tcache.entries[c] = ptr;
+                tcache.counts[c]++;
+                return;
+            }
+        }
+    }
+
+    arena_lock(a);
+    drain_remote_frees(a);
+    arena_release(a, ptr);
+    arena_unlock(a);
+}
+
+size_t t_usable_size(void *ptr) {
+    return ptr ? usable_size(ptr) : 0;
+}
+
+void *t_realloc(void *ptr, size_t size) {
+    if(ptr == NULL) return t_malloc(size);
+    if(size == 0) {
+        t_free(ptr);
+        return NULL;
+    }
+
+    size_t old_size = usable_size(ptr);
+    header* block = (header*)((char*)ptr - sizeof(header));
+
+    if(is_large(ptr)) {
+        if(size >= LARGE_THRESHOLD) {
+            void* moved = large_realloc(LARGE_BLOCK(block), size);
+            if(moved) {
+                stat_free(old_size);
+                return counted(moved);
+            }
+        }
+    } else if(in_slab_span(ptr)) {
+        if(size <= old_size) return ptr;
+    } else if(size > SLAB_MAX_SIZE && size < LARGE_THRESHOLD) {
+        arena* a = arena_of(ptr);
+        arena_lock(a);
+        bool resized = arena_resize(a, block, heap_payload_size(size));
+        arena_unlock(a);
+        if(resized) {
+            stat_free(old_size);
+            return counted(ptr);
+        }
+    }
+
+    // On failure the old block is left untouched, as with realloc.
+    void* new_ptr = t_malloc(size);
+    if(new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    t_free(ptr);
+    return new_ptr;
+}
+
+void *t_calloc(size_t nmemb, size_t size) {
+    if(size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t total = nmemb * size;
+    void* ptr = t_malloc(total);
+
+    // Fresh mappings are already zeroed by the kernel.
+    if(ptr && total < LARGE_THRESHOLD) memset(ptr, 0, total);
+    return ptr;
+}
+
+void t_set_release_threshold(size_t bytes) {
+    release_threshold = bytes;
+}
+
+size_t t_trim(size_t keep_bytes) {
+    size_t released = 0;
+
+    for(int i = 0; i < num_arenas; i++) {
+        arena* a = &arenas[i];
+        arena_lock(a);
+        drain_remote_frees(a);
+        size_t before = a->total_size;
+
+        while(a->empty_slabs) {
+            slab* s = a->empty_slabs;
+            a->empty_slabs = s->next;
+            a->empty_slab_count--;
+            if(!release_slab(a, s)) {
+                s->next = a->empty_slabs;
+                a->empty_slabs = s;
+                a->empty_slab_count++;
+                break;
+            }
+        }
+
+        trim_top(a, keep_bytes);
+        // The free tail keeps the `keep_bytes` that trim_top left committed.
+        for(header* block = a->headers_start; block != EPILOGUE(a); block = NEXT_BLOCK(block)) {
+            if(IS_FREE(block) && NEXT_BLOCK(block) != EPILOGUE(a)) release_block(a, block);
+        }
+
+        // Growing the released slab array can cost more than the pages dropped.
+        if(a->total_size < before) released += before - a->total_size;
+        arena_unlock(a);
+    }
+
+    return released;
+}
+
+/*
+ * t_gcollect is a conservative mark-and-sweep collector. A word on the calling
+ * thread's stack, in its registers or in a registered root range that points
+ * into an allocated block keeps the block alive, and so does such a word inside
+ * a live block. Heap and large blocks are looked up by binary search in
+ * address-sorted indexes built at the start of each collection; slab objects
+ * are found by masking, with a free and a mark bitmap per slab. All scratch
+ * space is mapped directly, so a collection never allocates from the heap it
+ * scans. The low bit of an indexed block's size is its mark.
+ */
+#define GC_MARK_BIT 1ULL
+
+typedef struct gc_range {
+    char* start;
+    size_t size;
+} gc_range;
+
+typedef struct gc_array {
+    gc_range* items;
+    size_t count;
+    size_t capacity;
+} gc_array;
+
+static gc_array gc_roots;
+static gc_stats gc_report;
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread char* gc_thread_stack_top;
+
+static gc_array gc_heap_objects;
+static gc_array gc_large_objects;
+static gc_array gc_mark_stack;
+static uint64_t* gc_slab_bits[MAX_ARENAS];
+static size_t gc_slab_bits_size[MAX_ARENAS];
+static size_t gc_slab_words;
+static bool gc_failed;
+
+// Appends a range, flagging the collection as failed if the array can't grow.
+static bool gc_push(gc_array* array, char* start, size_t size) {
+    if(array->count == array->capacity) {
+        size_t old_bytes = array->capacity * sizeof(gc_range);
+        size_t new_bytes = old_bytes ? old_bytes * 2 : (size_t)page_size;
+        gc_range* grown = grow_mapping(array->items, old_bytes, new_bytes);
+        if(grown == NULL) {
+            gc_failed = true;
+            return false;
+        }
+        array->items = grown;
+        array->capacity = new_bytes / sizeof(gc_range);
+    }
+
+    array->items[array->count].start = start;
+    array->items[array->count].size = size;
+    array->count++;
+    return true;
+}
+
+static void gc_array_release(gc_array* array) {
+    if(array->items) munmap(array->items, array->capacity * sizeof(gc_range));
+    array->items = NULL;
+    array->count = 0;
+    array->capacity = 0;
+}
+
+// The indexed block whose payload contains ptr, or NULL.
+static gc_range* gc_find(gc_array* array, char* ptr) {
+    size_t lo = 0, hi = array->count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(array->items[mid].start <= ptr) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo == 0) return NULL;
+
+    gc_range* object = &array->items[lo - 1];
+    return ptr < object->start + (object->size & ~GC_MARK_BIT) ? object : NULL;
+}
+
+// A slab's free bitmap, followed by its mark bitmap.
+static uint64_t* gc_slab_bits_of(slab* s) {
+    size_t offset = (char*)s - heap_base;
+    size_t page = (offset % ARENA_SPAN - SLAB_SPAN_OFFSET) / page_size;
+    return gc_slab_bits[offset / ARENA_SPAN] + page * 2 * gc_slab_words;
+}
+
+static void gc_mark_object(gc_range* object) {
+    if(object->size & GC_MARK_BIT) return;
+    object->size |= GC_MARK_BIT;
+    gc_push(&gc_mark_stack, object->start, object->size & ~GC_MARK_BIT);
+}
+
+static void gc_mark_pointer(char* ptr) {
+    if(is_large(ptr)) {
+        gc_range* object = gc_find(&gc_large_objects, ptr);
+        if(object) gc_mark_object(object);
+        return;
+    }
+    if((size_t)(ptr - heap_base) >= (size_t)num_arenas * ARENA_SPAN) return;
+
+    if(!in_slab_span(ptr)) {
+        gc_range* object = gc_find(&gc_heap_objects, ptr);
+        if(object) gc_mark_object(object);
+        return;
+    }
+
+    // Slab pages past slab_end are inaccessible; empty and released ones read as unused.
+    slab* s = slab_of(ptr);
+    if((char*)s >= arena_of(ptr)->slab_end || s->used == 0 || ptr < (char*)s + SLAB_HEADER_SIZE) return;
+
+    size_t index = (ptr - (char*)s - SLAB_HEADER_SIZE) / s->object_size;
+    if(index >= s->carved) return;
+
+    uint64_t* bits = gc_slab_bits_of(s);
+    uint64_t bit = 1ULL << (index % 64);
+    if((bits[index / 64] | bits[gc_slab_words + index / 64]) & bit) return;
+    bits[gc_slab_words + index / 64] |= bit;
+    gc_push(&gc_mark_stack, (char*)s + SLAB_HEADER_SIZE + index * s->object_size, s->object_size);
+}
+
+// Marks from every pointer-aligned word in [lo, hi), then from everything that reaches.
+static void gc_scan(char* lo, char* hi) {
+    char** word = (char**)(((uintptr_t)lo + sizeof(char*) - 1) & ~(uintptr_t)(sizeof(char*) - 1));
+    for(; (char*)(word + 1) <= hi; word++) gc_mark_pointer(*word);
+
+    while(gc_mark_stack.count > 0 && !gc_failed) {
+        gc_range object = gc_mark_stack.items[--gc_mark_stack.count];
+        word = (char**)object.start;
+        for(; (char*)(word + 1) <= object.start + object.size; word++) gc_mark_pointer(*word);
+    }
+}
+
+// Kept out of line so that the caller's frame, with the registers it saved, lies above this one.
+static __attribute__((noinline)) void gc_mark_roots(char* stack_top) {
+    char* stack_bottom = __builtin_frame_address(0);
+    gc_scan(stack_bottom, stack_top);
+
+    for(size_t i = 0; i < gc_roots.count; i++) {
+        gc_scan(gc_roots.items[i].start, gc_roots.items[i].start + gc_roots.items[i].size);
+    }
+}
+
+// Records every allocated block, and every free slab object, as of the start of the collection.
+static void gc_build_index(void) {
+    gc_slab_words = ((page_size - SLAB_HEADER_SIZE) / slab_class_sizes[0] + 63) / 64;
+
+    for(int i = 0; i < num_arenas; i++) {
+        arena* a = &arenas[i];
+        for(header* block = a->headers_start; block != EPILOGUE(a); block = NEXT_BLOCK(block)) {
+            if(!IS_FREE(block)) gc_push(&gc_heap_objects, (char*)block + sizeof(header), GET_SIZE(block));
+        }
+
+        char* slab_base = heap_base + i * ARENA_SPAN + SLAB_SPAN_OFFSET;
+        size_t bytes = (a->slab_end - slab_base) / page_size * 2 * gc_slab_words * sizeof(uint64_t);
+        if(bytes == 0) continue;
+
+        gc_slab_bits_size[i] = (bytes + page_size - 1) & ~(page_size - 1);
+        gc_slab_bits[i] = grow_mapping(NULL, 0, gc_slab_bits_size[i]);
+        if(gc_slab_bits[i] == NULL) {
+            gc_failed = true;
+            continue;
+        }
+
+        for(char* page = slab_base; page < a->slab_end; page += page_size) {
+            slab* s = (slab*)page;
+            if(s->used == 0) continue;
+
+            uint64_t* bits = gc_slab_bits_of(s);
+            for(char* obj = s->free_list; obj != NULL; obj = *(char**)obj) {
+                size_t index = (obj - page - SLAB_HEADER_SIZE) / s->object_size;
+                bits[index / 64] |= 1ULL << (index % 64);
+            }
+        }
+    }
+
+    // Large mappings come in no particular order, and there are few of them.
+    for(large_block* block = large_blocks; block != NULL; block = block->next) {
+        if(!gc_push(&gc_large_objects, (char*)block + sizeof(large_block), GET_SIZE(&block->hdr))) break;
+
+        gc_range* items = gc_large_objects.items;
+        for(size_t j = gc_large_objects.count - 1; j > 0 && items[j - 1].start > items[j].start; j--) {
+            gc_range swap = items[j];
+            items[j] = items[j - 1];
+            items[j - 1] = swap;
+        }
+    }
+}
+
+// Frees every block left unmarked. Returns the payload bytes reclaimed.
+static size_t gc_sweep(size_t* reclaimed_blocks) {
+    size_t reclaimed = 0;
+
+    for(size_t i = 0; i < gc_heap_objects.count; i++) {
+        gc_range* object = &gc_heap_objects.items[i];
+        if(object->size & GC_MARK_BIT) continue;
+
+        arena_free(arena_of(object->start), (header*)(object->start - sizeof(header)));
+        stat_free(object->size);
+        reclaimed += object->size;
+        (*reclaimed_blocks)++;
+    }
+
+    for(size_t i = 0; i < gc_large_objects.count; i++) {
+        gc_range* object = &gc_large_objects.items[i];
+        if(object->size & GC_MARK_BIT) continue;
+
+        large_block* block = LARGE_BLOCK(object->start - sizeof(header));
+        char* map = large_map_start(block);
+        size_t map_size = large_map_size(block);
+        large_forget(block);
+        munmap(map, map_size);
+        stat_free(object->size);
+        reclaimed += object->size;
+        (*reclaimed_blocks)++;
+    }
+
+    for(int i = 0; i < num_arenas; i++) {
+        arena* a = &arenas[i];
+        char* slab_base = heap_base + i * ARENA_SPAN + SLAB_SPAN_OFFSET;
+        for(char* page = slab_base; page < a->slab_end; page += page_size) {
+            slab* s = (slab*)page;
+            if(s->used == 0) continue;
+
+            // A slab that empties may be released, so its header is read up front.
+            uint64_t* bits = gc_slab_bits_of(s);
+            uint32_t carved = s->carved;
+            uint32_t object_size = s->object_size;
+            for(uint32_t index = 0; index < carved && s->used > 0; index++) {
+                uint64_t bit = 1ULL << (index % 64);
+                if((bits[index / 64] | bits[gc_slab_words + index / 64]) & bit) continue;
+
+                slab_free(a, page + SLAB_HEADER_SIZE + (size_t)index * object_size);
+                stat_free(object_size);
+                reclaimed += object_size;
+                (*reclaimed_blocks)++;
+            }
+        }
+    }
+
+    return reclaimed;
+}
+
+static void gc_release_scratch(void) {
+    gc_array_release(&gc_heap_objects);
+    gc_array_release(&gc_large_objects);
+    gc_array_release(&gc_mark_stack);
+    for(int i = 0; i < MAX_ARENAS; i++) {
+        if(gc_slab_bits[i]) munmap(gc_slab_bits[i], gc_slab_bits_size[i]);
+        gc_slab_bits[i] = NULL;
+        gc_slab_bits_size[i] = 0;
+    }
+}
+
+// The top of the calling thread's stack, looked up once per thread since it may allocate.
+static char* gc_stack_top(void) {
+    if(gc_thread_stack_top == NULL) {
+        pthread_attr_t attr;
+        void* addr;
+        size_t size;
+        if(pthread_getattr_np(pthread_self(), &attr) != 0) return NULL;
+        if(pthread_attr_getstack(&attr, &addr, &size) == 0) gc_thread_stack_top = (char*)addr + size;
+        pthread_attr_destroy(&attr);
+    }
+    return gc_thread_stack_top;
+}
+
+void t_gcollect(void) {
+    if(heap_base == NULL) return;
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    char* stack_top = gc_stack_top();
+
+    pthread_mutex_lock(&gc_lock);
+    for(int i = 0; i < num_arenas; i++) {
+        arena_lock(&arenas[i]);
+        drain_remote_frees(&arenas[i]);
+    }
+    large_lock_acquire();
+
+    // Cached objects are free, but their slabs count them as in use.
+    pthread_mutex_lock(&tcache_list_lock);
+    for(thread_cache* cache = tcaches; cache != NULL; cache = cache->next) {
+        if(cache->generation == heap_generation) tcache_drain(cache);
+    }
+    pthread_mutex_unlock(&tcache_list_lock);
+
+    size_t reclaimed = 0;
+    size_t reclaimed_blocks = 0;
+    gc_failed = stack_top == NULL;
+    if(!gc_failed) gc_build_index();
+
+    // A collection that can't find the stack or runs out of scratch memory frees nothing rather than something live.
+    if(!gc_failed) {
+        jmp_buf registers;
+        setjmp(registers);
+        gc_mark_roots(stack_top);
+        if(!gc_failed) reclaimed = gc_sweep(&reclaimed_blocks);
+    }
+    gc_release_scratch();
+
+    large_lock_release();
+    for(int i = 0; i < num_arenas; i++) arena_unlock(&arenas[i]);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double pause_ms = (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+    gc_report.collections++;
+    gc_report.last_pause_ms = pause_ms;
+    gc_report.last_reclaimed_bytes = reclaimed;
+    gc_report.last_reclaimed_blocks = reclaimed_blocks;
+    gc_report.total_pause_ms += pause_ms;
+    gc_report.total_reclaimed_bytes += reclaimed;
+    pthread_mutex_unlock(&gc_lock);
+}
+
+int t_gc_add_root(void* start, size_t size) {
+    pthread_mutex_lock(&gc_lock);
+    if(page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+    bool added = gc_push(&gc_roots, start, size);
+    pthread_mutex_unlock(&gc_lock);
+
+    if(added) return 0;
+    errno = ENOMEM;
+    return -1;
+}
+
+void t_gc_remove_root(void* start) {
+    pthread_mutex_lock(&gc_lock);
+    for(size_t i = 0; i < gc_roots.count; i++) {
+        if(gc_roots.items[i].start == start) {
+            gc_roots.items[i] = gc_roots.items[--gc_roots.count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gc_lock);
+}
+
+gc_stats t_gc_get_stats(void) {
+    pthread_mutex_lock(&gc_lock);
+    gc_stats stats = gc_report;
+    pthread_mutex_unlock(&gc_lock);
+    return stats;
+}
+
+/*
+ * The locks are taken in the order t_gcollect uses, with the list locks last.
+ * In the child only the forking thread survives, so every lock is reset rather
+ * than unlocked.
+ */
+void t_fork_prepare(void) {
+    pthread_mutex_lock(&gc_lock);
+    for(int i = 0; i < num_arenas; i++) pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&large_lock);
+    pthread_mutex_lock(&tcache_list_lock);
+    pthread_mutex_lock(&tstats_lock);
+}
+
+void t_fork_parent(void) {
+    pthread_mutex_unlock(&tstats_lock);
+    pthread_mutex_unlock(&tcache_list_lock);
+    pthread_mutex_unlock(&large_lock);
+    for(int i = num_arenas - 1; i >= 0; i--) pthread_mutex_unlock(&arenas[i].lock);
+    pthread_mutex_unlock(&gc_lock);
+}
+
+void t_fork_child(void) {
+    pthread_mutex_init(&tstats_lock, NULL);
+    pthread_mutex_init(&tcache_list_lock, NULL);
+    pthread_mutex_init(&large_lock, NULL);
+    for(int i = 0; i < num_arenas; i++) pthread_mutex_init(&arenas[i].lock, NULL);
+    pthread_mutex_init(&gc_lock, NULL);
+}
+
+void t_stats_enable(bool enabled) {
+    stats_enabled = enabled;
+}
+
+static void add_thread_stats(alloc_stats* stats, thread_stats* counters) {
+    for(int c = 0; c < TDMM_SIZE_CLASSES; c++) {
+        stats->alloc_count[c] += __atomic_load_n(&counters->alloc_count[c], __ATOMIC_RELAXED);
+        stats->free_count[c] += __atomic_load_n(&counters->free_count[c], __ATOMIC_RELAXED);
+    }
+    for(int b = 0; b < TDMM_SEARCH_BUCKETS; b++) {
+        stats->search_length[b] += __atomic_load_n(&counters->search_length[b], __ATOMIC_RELAXED);
+    }
+}
+
+alloc_stats t_get_stats(void) {
+    alloc_stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    pthread_mutex_lock(&tstats_lock);
+    add_thread_stats(&stats, &retired_stats);
+    for(thread_stats* counters = tstats_list; counters != NULL; counters = counters->next) add_thread_stats(&stats, counters);
+    pthread_mutex_unlock(&tstats_lock);
+
+    if(heap_base == NULL) return stats;
+    for(int i = 0; i < num_arenas; i++) {
+        arena* a = &arenas[i];
+        arena_lock(a);
+        for(header* block = a->headers_start; block != EPILOGUE(a); block = NEXT_BLOCK(block)) {
+            if(!IS_FREE(block)) continue;
+            stats.free_blocks++;
+            stats.free_bytes += GET_SIZE(block);
+            if(GET_SIZE(block) > stats.largest_free_block) stats.largest_free_block = GET_SIZE(block);
+        }
+        arena_unlock(a);
+    }
+
+    if(stats.free_bytes > 0) stats.external_fragmentation = 1.0 - (double)stats.largest_free_block / stats.free_bytes;
+    return stats;
+}
+
+#define HEAP_DUMP_VERSION 1
+#define HEAP_DUMP_BATCH 256
+
+enum {
+    DUMP_ALLOCATED,
+    DUMP_FREE,
+    DUMP_RELEASED,
+    DUMP_SLAB,
+    DUMP_LARGE,
+};
+
+typedef struct dump_record {
+    uint8_t kind;
+    uint8_t arena;
+    uint16_t reserved;
+    uint32_t used;
+    uint64_t address;
+    uint64_t size;
+} dump_record;
+
+// Records are batched on the stack and written with write(2), so dumping never touches the heap being dumped.
+typedef struct dump_writer {
+    int fd;
+    bool failed;
+    size_t count;
+    dump_record records[HEAP_DUMP_BATCH];
+} dump_writer;
+
+static void dump_bytes(dump_writer* writer, const void* data, size_t len) {
+    const char* p = data;
+    while(len > 0 && !writer->failed) {
+        ssize_t written = write(writer->fd, p, len);
+        if(written <= 0) writer->failed = true;
+        else {
+            p += written;
+            len -= written;
+        }
+    }
+}
+
+static void dump_flush(dump_writer* writer) {
+    dump_bytes(writer, writer->records, writer->count * sizeof(dump_record));
+    writer->count = 0;
+}
+
+static void dump_add(dump_writer* writer, int kind, int arena_index, uint32_t used, void* address, size_t size) {
+    dump_record* record = &writer->records[writer->count++];
+    memset(record, 0, sizeof(*record));
+    record->kind = kind;
+    record->arena = arena_index;
+    record->used = used;
+    record->address = (uintptr_t)address;
+    record->size = size;
+    if(writer->count == HEAP_DUMP_BATCH) dump_flush(writer);
+}
+
+int t_heap_dump(const char* path) {
+    dump_writer writer;
+    writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(writer.fd < 0) return -1;
+    writer.failed = false;
+    writer.count = 0;
+
+    uint32_t info[4] = {HEAP_DUMP_VERSION, (uint32_t)page_size, (uint32_t)num_arenas, (uint32_t)strategy};
+    dump_bytes(&writer, "TDMMHEAP", 8);
+    dump_bytes(&writer, info, sizeof(info));
+
+    for(int i = 0; heap_base != NULL && i < num_arenas; i++) arena_lock(&arenas[i]);
+    large_lock_acquire();
+
+    for(int i = 0; heap_base != NULL && i < num_arenas; i++) {
+        arena* a = &arenas[i];
+        for(header* block = a->headers_start; block != EPILOGUE(a); block = NEXT_BLOCK(block)) {
+            int kind = !IS_FREE(block) ? DUMP_ALLOCATED : IS_RELEASED(block) ? DUMP_RELEASED : DUMP_FREE;
+            dump_add(&writer, kind, i, 0, (char*)block + sizeof(header), GET_SIZE(block));
+        }
+
+        // Empty and released slabs are unused pages, so only slabs with live objects are recorded.
+        char* slab_base = heap_base + i * ARENA_SPAN + SLAB_SPAN_OFFSET;
+        for(char* page = slab_base; page < a->slab_end; page += page_size) {
+            slab* s = (slab*)page;
+            if(s->used > 0) dump_add(&writer, DUMP_SLAB, i, s->used, page, s->object_size);
+        }
+    }
+    for(large_block* block = large_blocks; block != NULL; block = block->next) {
+        dump_add(&writer, DUMP_LARGE, 0, 0, (char*)block + sizeof(large_block), GET_SIZE(&block->hdr));
+    }
+
+    large_lock_release();
+    for(int i = 0; heap_base != NULL && i < num_arenas; i++) arena_unlock(&arenas[i]);
+
+    dump_flush(&writer);
+    if(close(writer.fd) != 0) writer.failed = true;
+    return writer.failed ? -1 : 0;
+}
+
+// Sums the counters of every arena and the large-block list.
+static void collect_totals(size_t* requested_size, size_t* total_size, size_t* data_structure_overhead) {
+    *requested_size = 0;
+    *total_size = 0;
+    *data_structure_overhead = 0;
+    for(int i = 0; i < num_arenas; i++) {
+        arena_lock(&arenas[i]);
+        *requested_size += arenas[i].requested_size;
+        *total_size += arenas[i].total_size;
+        *data_structure_overhead += arenas[i].data_structure_overhead;
+        arena_unlock(&arenas[i]);
+    }
+
+    large_lock_acquire();
+    *requested_size += large_requested_size;
+    *total_size += large_total_size;
+    *data_structure_overhead += large_overhead;
+    large_lock_release();
+}
+
+void t_display_stats() {
+    size_t requested_size, total_size, data_structure_overhead;
+    collect_totals(&requested_size, &total_size, &data_structure_overhead);
+
+    size_t slab_count = 0;
+    size_t slab_bytes = 0;
+    for(int i = 0; i < num_arenas; i++) {
+        arena_lock(&arenas[i]);
+        slab_count += arenas[i].slab_count;
+        slab_bytes += arenas[i].slab_end - (heap_base + i * ARENA_SPAN + SLAB_SPAN_OFFSET)
+                      - arenas[i].released_slab_count * page_size;
+        arena_unlock(&arenas[i]);
+    }
+
+    size_t large_count = 0;
+    large_lock_acquire();
+    for(large_block* block = large_blocks; block != NULL; block = block->next) large_count++;
+    size_t large_bytes = large_total_size;
+    large_lock_release();
+
+    printf("Total bytes requested from sys: %zu bytes\n", total_size);
+    printf("Data structure overhead: %zu bytes (%.5f%%)\n", data_structure_overhead, (double)data_structure_overhead / total_size * 100);
+    printf("Slab tier: %zu slabs in use, %zu bytes committed\n", slab_count, slab_bytes);
+    printf("Large tier: %zu mappings, %zu bytes mapped\n", large_count, large_bytes);
+
+    alloc_stats stats = t_get_stats();
+    printf("Free blocks: %zu, %zu bytes, largest %zu bytes (external fragmentation %.2f%%)\n",
+           stats.free_blocks, stats.free_bytes, stats.largest_free_block, stats.external_fragmentation * 100);
+
+    gc_stats collections = t_gc_get_stats();
+    if(collections.collections > 0) {
+        printf("Garbage collection: %zu collections, %zu bytes reclaimed, last pause %.3f ms\n",
+               collections.collections, collections.total_reclaimed_bytes, collections.last_pause_ms);
+    }
+}
+
+size_t t_get_ds_overhead() {
+    size_t requested_size, total_size, data_structure_overhead;
+    collect_totals(&requested_size, &total_size, &data_structure_overhead);
+    return data_structure_overhead;
+}
+
+double t_get_usage() {
+    size_t requested_size, total_size, data_structure_overhead;
+    collect_totals(&requested_size, &total_size, &data_structure_overhead);
+    return (double)requested_size / total_size * 100;
+}
@@ -7,10 +7,13 @@
 typedef struct header header;
 typedef struct allocator allocator;
 
+/*
+ * Block header: the payload size with status bits packed into its low three bits.
+ * Neighbouring blocks are located from the size and from the boundary tag that
+ * ends every free block.
+ */
 struct header {
     size_t size;
-    header* next;
-    header* prev;
 };
 
 typedef enum {
@@ -26,14 +29,43 @@ typedef enum {
  */
 void t_init(alloc_strat_e strat);
 
+/**
+ * Initializes the memory allocator for use from multiple threads.
+ *
+ * Threads are spread round-robin over `arena_count` independent heaps, each with
+ * its own lock, and cache small freed blocks locally. Blocks freed by a thread
+ * that does not own them are queued back to their arena without taking its lock.
+ * Like t_init, this must not run while other threads are using the allocator.
+ *
+ * @param strat The strategy to use for memory allocation.
+ * @param arena_count The number of arenas, clamped to [1, 16].
+ */
+void t_init_mt(alloc_strat_e strat, int arena_count);
+
 /**
  * Allocates a block of memory of the given size.
  *
+ * The block is aligned to at least 16 bytes.
+ *
  * @param size The size of the memory block to allocate.
- * @return A pointer to the allocated memory block fails.
+ * @return A pointer to the allocated memory block, or NULL if size is 0 or on failure.
+ *         Running out of memory, or allocating before t_init, sets errno to ENOMEM.
  */
 void *t_malloc(size_t size);
 
+/**
+ * Allocates a block of memory whose address is a multiple of `alignment`.
+ *
+ * The block is carved out of a larger free block, and the slack in front of it
+ * goes back to the free list. It is released with t_free like any other block.
+ *
+ * @param alignment The alignment in bytes, a power of two (e.g. 32, 64 or 4096).
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the aligned block, or NULL if alignment is not a power of two, size is 0
+ *         or memory runs out (errno ENOMEM). An alignment too large for any mapping counts as running out.
+ */
+void *t_aligned_alloc(size_t alignment, size_t size);
+
 /**
  * Frees the given memory block.
  *
@@ -41,11 +73,172 @@ void *t_malloc(size_t size);
  */
 void t_free(void *ptr);
 
+/**
+ * Returns how many bytes of the block at ptr the caller may use, which is at least the requested size.
+ *
+ * @param ptr A pointer returned by the allocator, or NULL.
+ * @return The usable size of the block, or 0 for NULL.
+ */
+size_t t_usable_size(void *ptr);
+
+/**
+ * Resizes the given memory block, keeping its contents up to the smaller of the old and new sizes.
+ *
+ * Large blocks are grown with mremap and heap blocks by absorbing a free neighbour;
+ * the data is only copied when neither is possible.
+ *
+ * @param ptr The block to resize, or NULL to allocate a new one.
+ * @param size The new size. A size of 0 frees the block and returns NULL.
+ * @return A pointer to the resized block, which may differ from ptr, or NULL on failure, in
+ *         which case ptr is left as it was.
+ */
+void *t_realloc(void *ptr, size_t size);
+
+/**
+ * Allocates zeroed memory for an array of nmemb elements of the given size.
+ *
+ * @param nmemb The number of elements.
+ * @param size The size of each element.
+ * @return A pointer to the zeroed memory, or NULL if nmemb * size overflows or memory runs out
+ *         (errno ENOMEM).
+ */
+void *t_calloc(size_t nmemb, size_t size);
+
+/*
+ * What garbage collection has done: the last collection, and totals over every
+ * collection since start-up.
+ */
+typedef struct gc_stats {
+    size_t collections;
+    double last_pause_ms;
+    size_t last_reclaimed_bytes;
+    size_t last_reclaimed_blocks;
+    double total_pause_ms;
+    size_t total_reclaimed_bytes;
+} gc_stats;
+
 /**
  * Performs basic garbage collection by scanning the stack and heap managed by t_malloc and t_free.
+ *
+ * The collector is conservative: any word in the calling thread's registers or
+ * stack, in a range registered with t_gc_add_root, or in a reachable block that
+ * points into an allocated block keeps it alive. Every other block is freed.
+ * Globals and the stacks of other threads are only scanned when registered as
+ * roots, and like t_init this must not run while other threads use the allocator.
+ * If the bounds of the calling thread's stack can't be found, nothing is freed.
  */
 void t_gcollect(void);
 
+/**
+ * Registers a range of memory outside the heap, such as a global, that t_gcollect scans for pointers.
+ *
+ * @param start The start of the range.
+ * @param size The size of the range in bytes.
+ * @return 0 on success, or -1 with errno set to ENOMEM if the range could not be recorded.
+ */
+int t_gc_add_root(void *start, size_t size);
+
+/**
+ * Stops t_gcollect from scanning a range registered with t_gc_add_root.
+ *
+ * @param start The start of the range, as passed to t_gc_add_root.
+ */
+void t_gc_remove_root(void *start);
+
+/**
+ * Reports the pause time and reclaimed memory of garbage collection.
+ *
+ * @return The statistics of the last collection and the totals so far.
+ */
+gc_stats t_gc_get_stats(void);
+
+/**
+ * Returns unused memory to the OS: empty slabs, the whole pages inside free blocks,
+ * and the free tail of each heap beyond `keep_bytes`.
+ *
+ * @param keep_bytes How much of each heap's free tail to keep committed for reuse.
+ * @return The number of bytes given back.
+ */
+size_t t_trim(size_t keep_bytes);
+
+/**
+ * Sets the size from which t_free hands a coalesced free block back to the OS
+ * (128 KiB by default). Pass SIZE_MAX to only release memory through t_trim.
+ * The free tail of the heap is kept at this size and only trimmed once it grows
+ * to twice as much, and a free block inside the heap is released at most once
+ * per 64 times this many bytes freed.
+ *
+ * @param bytes The smallest free block whose pages are released automatically.
+ */
+void t_set_release_threshold(size_t bytes);
+
+/**
+ * pthread_atfork handlers that keep the allocator usable in the child of a
+ * multi-threaded fork: t_fork_prepare takes every allocator lock so that no
+ * other thread is midway through an allocation when the address space is
+ * copied, and the other two release them again.
+ */
+void t_fork_prepare(void);
+void t_fork_parent(void);
+void t_fork_child(void);
+
+#define TDMM_SIZE_CLASSES 48
+#define TDMM_SEARCH_BUCKETS 16
+
+/*
+ * Allocator statistics. The counters are kept per thread and summed on read;
+ * they need the library built with TDMM_STATS and are only updated while
+ * enabled with t_stats_enable. The free-block figures are measured on every
+ * read regardless, from the heap blocks of all arenas.
+ *
+ * Size class c counts blocks of (2^(c-1), 2^c] usable bytes, and search bucket
+ * b counts find_free_block calls that visited [2^(b-1), 2^b) free blocks or
+ * bins (bucket 0: none).
+ */
+typedef struct alloc_stats {
+    size_t alloc_count[TDMM_SIZE_CLASSES];
+    size_t free_count[TDMM_SIZE_CLASSES];
+    size_t search_length[TDMM_SEARCH_BUCKETS];
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free_block;
+    double external_fragmentation;
+} alloc_stats;
+
+/**
+ * Turns the statistics counters on or off. They start off and are cleared by t_init.
+ *
+ * @param enabled Whether allocations, frees and searches are counted from now on.
+ */
+void t_stats_enable(bool enabled);
+
+/**
+ * Reads the allocator statistics.
+ *
+ * external_fragmentation is 1 - largest_free_block / free_bytes: 0 when all
+ * free heap memory is one block, approaching 1 as it splinters.
+ *
+ * @return The counters summed over all threads, and the current free-block figures.
+ */
+alloc_stats t_get_stats(void);
+
+/**
+ * Writes a binary snapshot of the block map to a file for offline analysis.
+ *
+ * The file starts with the magic "TDMMHEAP" and four 32-bit integers: the
+ * format version (1), the page size, the number of arenas and the strategy.
+ * Then follows one 24-byte record per heap block, slab and large mapping: a
+ * 8-bit kind (0 allocated, 1 free, 2 free and released to the OS, 3 slab,
+ * 4 large), the 8-bit arena index, 16 reserved bits, a 32-bit count of objects
+ * in use (slabs only), the 64-bit block address and the 64-bit size (the
+ * payload size, or the object size for slabs). Everything is in host byte
+ * order. The snapshot is written without allocating, under the arena locks.
+ *
+ * @param path The file to create or truncate.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int t_heap_dump(const char *path);
+
 void t_display_stats();
 double t_get_usage();
 size_t t_get_ds_overhead();
@@ -1,15 +1,27 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include "bench.h"
 #include "tdmm.h"
 
 #define NUM_OPERATIONS 10000
+#define SPEED_SAMPLES 1001
+
+#define BENCH_OPS 200000
+#define BENCH_SLOTS 4096
+
+#define MT_OPS_PER_THREAD 200000
+#define MT_WINDOW 256
+#define MT_SHARED_SLOTS 64
 
 double get_elapsed_time(struct timespec start, struct timespec end) {
     return (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
 }
 
-void run_benchmarks_for_policy(alloc_strat_e strat, const char* policy_name, FILE* average_util, FILE* overhead) {
+void run_benchmarks_for_policy(alloc_strat_e strat, const char* policy_name, FILE* average_util, FILE* overhead,
+                               FILE* fragmentation, FILE* search_length) {
     char speed_filename[256];
     char util_filename[256];
 
@@ -26,24 +38,20 @@ void run_benchmarks_for_policy(alloc_strat_e strat, const char* policy_name, FIL
     fprintf(speed_graph, "Size(Bytes),MallocTime(ns),FreeTime(ns)\n");
     fprintf(util_graph, "Time(ns),Utilization(%%)\n");
 
-    struct timespec start, end, start_time, current_time;
+    struct timespec start_time, current_time;
     const size_t MAX_SIZE = 1024*1024*8;
 
-    for (size_t size = 1; size <= MAX_SIZE; size *= 2) {
-        t_init(strat);
-
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        void* ptr = t_malloc(size);
-        clock_gettime(CLOCK_MONOTONIC, &end);
-        double malloc_time = get_elapsed_time(start, end);
-
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        t_free(ptr);
-        clock_gettime(CLOCK_MONOTONIC, &end);
-        double free_time = get_elapsed_time(start, end);
+    // Time each size on a heap already fragmented by a mixed workload rather than on an empty one.
+    trace background = {0};
+    trace_uniform(&background, 20000, 2048, 1, 4096, 1);
+    bench_allocator alloc = {policy_name, strat, t_init, t_malloc, t_free};
 
+    for (size_t size = 1; size <= MAX_SIZE; size *= 2) {
+        double malloc_time, free_time;
+        bench_size_latency(&background, &alloc, size, SPEED_SAMPLES, &malloc_time, &free_time);
         fprintf(speed_graph, "%zu,%.0f,%.0f\n", size, malloc_time, free_time);
     }
+    trace_destroy(&background);
 
     t_init(strat);
     clock_gettime(CLOCK_MONOTONIC, &start_time);
@@ -85,6 +93,13 @@ void run_benchmarks_for_policy(alloc_strat_e strat, const char* policy_name, FIL
     fprintf(average_util, "%s,%.2f\n", policy_name, average_utilization/NUM_OPERATIONS);
     fprintf(overhead, "%s,%zu\n", policy_name, t_get_ds_overhead());
 
+    alloc_stats stats = t_get_stats();
+    fprintf(fragmentation, "%s,%zu,%zu,%.2f\n", policy_name, stats.free_blocks, stats.largest_free_block,
+            stats.external_fragmentation * 100);
+    for (int b = 0; b < TDMM_SEARCH_BUCKETS; b++) {
+        fprintf(search_length, "%s,%d,%zu\n", policy_name, b == 0 ? 0 : 1 << (b - 1), stats.search_length[b]);
+    }
+
     // Print required console statistics
     printf("Results for %s: \n", policy_name);
     printf("Average Memory Utilization: %.2f%%\n", average_utilization/NUM_OPERATIONS);
@@ -92,23 +107,133 @@ void run_benchmarks_for_policy(alloc_strat_e strat, const char* policy_name, FIL
     printf("\n");
 }
 
-int main() {
+static void* mt_shared[MT_SHARED_SLOTS];
+
+// Churns small blocks in a private window, handing one in eight to whichever thread picks up its shared slot.
+void* mt_worker(void* arg) {
+    unsigned seed = (unsigned)(size_t)arg;
+    void* window[MT_WINDOW] = {NULL};
+
+    for (int i = 0; i < MT_OPS_PER_THREAD; i++) {
+        int slot = rand_r(&seed) % MT_WINDOW;
+
+        if (window[slot] == NULL) {
+            size_t alloc_size = (rand_r(&seed) % 16 == 0) ? (rand_r(&seed) % 16384) + 1 : (rand_r(&seed) % 512) + 1;
+            window[slot] = t_malloc(alloc_size);
+            *(char*)window[slot] = 1;
+        } else if (rand_r(&seed) % 8 == 0) {
+            int shared = rand_r(&seed) % MT_SHARED_SLOTS;
+            t_free(__atomic_exchange_n(&mt_shared[shared], window[slot], __ATOMIC_ACQ_REL));
+            window[slot] = NULL;
+        } else {
+            t_free(window[slot]);
+            window[slot] = NULL;
+        }
+    }
+
+    for (int i = 0; i < MT_WINDOW; i++) t_free(window[i]);
+    return NULL;
+}
+
+void run_thread_scaling_for_policy(alloc_strat_e strat, const char* policy_name, FILE* scaling) {
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 1) max_threads = 1;
+
+    printf("Thread scaling for %s: \n", policy_name);
+    for (long threads = 1; threads <= max_threads; threads++) {
+        t_init_mt(strat, (int)threads);
+        pthread_t workers[threads];
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long t = 0; t < threads; t++) pthread_create(&workers[t], NULL, mt_worker, (void*)(size_t)(t + 1));
+        for (long t = 0; t < threads; t++) pthread_join(workers[t], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (int i = 0; i < MT_SHARED_SLOTS; i++) {
+            t_free(mt_shared[i]);
+            mt_shared[i] = NULL;
+        }
+
+        double ops_per_sec = threads * MT_OPS_PER_THREAD / (get_elapsed_time(start, end) / 1e9);
+        fprintf(scaling, "%s,%ld,%.0f\n", policy_name, threads, ops_per_sec);
+        printf("%ld thread(s): %.0f ops/sec\n", threads, ops_per_sec);
+    }
+    printf("\n");
+}
+
+// Replays each workload against every policy and against glibc malloc as a baseline.
+void run_trace_benchmarks(trace* workloads, const char* const* names, int count) {
+    const bench_allocator allocators[] = {
+        {"First_Fit", FIRST_FIT, t_init, t_malloc, t_free},
+        {"Best_Fit", BEST_FIT, t_init, t_malloc, t_free},
+        {"Worst_Fit", WORST_FIT, t_init, t_malloc, t_free},
+        {"glibc", FIRST_FIT, NULL, malloc, free},
+    };
+
+    FILE* results = fopen("trace_benchmarks.csv", "w");
+    if (!results) {
+        printf("Failed to open trace_benchmarks.csv\n");
+        return;
+    }
+    bench_run_all(workloads, names, count, allocators, sizeof(allocators) / sizeof(allocators[0]), results);
+    fclose(results);
+}
+
+// Benchmarks the synthetic workloads, or the traces named on the command line instead.
+int main(int argc, char** argv) {
     int random = time(NULL);
     srand(random);
     
     FILE* average_util = fopen("average_utilization.csv", "w");
     FILE* overhead = fopen("overhead.csv", "w");
+    FILE* fragmentation = fopen("fragmentation.csv", "w");
+    FILE* search_length = fopen("search_length.csv", "w");
+    fprintf(fragmentation, "Policy,FreeBlocks,LargestFreeBlock(Bytes),ExternalFragmentation(%%)\n");
+    fprintf(search_length, "Policy,MinVisited,Searches\n");
+    t_stats_enable(true);
 
-    run_benchmarks_for_policy(FIRST_FIT, "First_Fit", average_util, overhead);
+    run_benchmarks_for_policy(FIRST_FIT, "First_Fit", average_util, overhead, fragmentation, search_length);
 
     srand(random);
-    run_benchmarks_for_policy(BEST_FIT,  "Best_Fit", average_util, overhead);
+    run_benchmarks_for_policy(BEST_FIT,  "Best_Fit", average_util, overhead, fragmentation, search_length);
 
     srand(random);
-    run_benchmarks_for_policy(WORST_FIT, "Worst_Fit", average_util, overhead);
+    run_benchmarks_for_policy(WORST_FIT, "Worst_Fit", average_util, overhead, fragmentation, search_length);
     
+    t_stats_enable(false);
     fclose(average_util);
     fclose(overhead);
+    fclose(fragmentation);
+    fclose(search_length);
+
+    FILE* scaling = fopen("thread_scaling.csv", "w");
+    fprintf(scaling, "Policy,Threads,OpsPerSec\n");
+    run_thread_scaling_for_policy(FIRST_FIT, "First_Fit", scaling);
+    run_thread_scaling_for_policy(BEST_FIT, "Best_Fit", scaling);
+    run_thread_scaling_for_policy(WORST_FIT, "Worst_Fit", scaling);
+    fclose(scaling);
+
+    if (argc > 1) {
+        int count = argc - 1;
+        trace workloads[count];
+        for (int i = 0; i < count; i++) {
+            if (trace_load(&workloads[i], argv[i + 1]) != 0) {
+                printf("Failed to load trace %s\n", argv[i + 1]);
+                return 1;
+            }
+        }
+        run_trace_benchmarks(workloads, (const char* const*)argv + 1, count);
+        for (int i = 0; i < count; i++) trace_destroy(&workloads[i]);
+    } else {
+        trace workloads[3] = {{0}};
+        const char* names[3] = {"Uniform", "Power_Law", "Producer_Consumer"};
+        trace_uniform(&workloads[0], BENCH_OPS, BENCH_SLOTS, 1, 4096, random);
+        trace_power_law(&workloads[1], BENCH_OPS, BENCH_SLOTS, 16, 1024*1024, 1.2, random);
+        trace_producer_consumer(&workloads[2], BENCH_OPS, BENCH_SLOTS, 32, 8192, random);
+        run_trace_benchmarks(workloads, names, 3);
+        for (int i = 0; i < 3; i++) trace_destroy(&workloads[i]);
+    }
 
     printf("Benchmarking complete. CSV files generated successfully.\n");
     return 0;
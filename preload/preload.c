@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include "tdmm.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Interposes the malloc family on top of libtdmm, for running unmodified
+ * programs with LD_PRELOAD. The allocator is set up on the first call, in
+ * threaded mode since any program may start threads later:
+ *
+ *   TDMM_STRATEGY  first (default), best or worst
+ *   TDMM_ARENAS    arena count, defaulting to the number of online CPUs
+ *
+ * Nothing here may allocate through libc, or it would re-enter itself.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static bool initialized;
+
+static alloc_strat_e strategy_from_env(void) {
+    const char* name = getenv("TDMM_STRATEGY");
+    if(name == NULL) return FIRST_FIT;
+    if(strcmp(name, "best") == 0) return BEST_FIT;
+    if(strcmp(name, "worst") == 0) return WORST_FIT;
+    return FIRST_FIT;
+}
+
+static int arenas_from_env(void) {
+    const char* count = getenv("TDMM_ARENAS");
+    if(count != NULL && atoi(count) > 0) return atoi(count);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static void init_allocator(void) {
+    t_init_mt(strategy_from_env(), arenas_from_env());
+    __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+}
+
+static void ensure_initialized(void) {
+    if(!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) pthread_once(&init_once, init_allocator);
+}
+
+// Registered once the program is running, since pthread_atfork itself may allocate.
+__attribute__((constructor)) static void install_fork_handlers(void) {
+    ensure_initialized();
+    pthread_atfork(t_fork_prepare, t_fork_parent, t_fork_child);
+}
+
+// Unlike t_malloc, malloc(0) must return a unique pointer that free accepts.
+void* malloc(size_t size) {
+    ensure_initialized();
+    return t_malloc(size ? size : 1);
+}
+
+void free(void* ptr) {
+    t_free(ptr);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    ensure_initialized();
+    if(nmemb == 0 || size == 0) return t_calloc(1, 1);
+    return t_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    ensure_initialized();
+    return t_realloc(ptr, size);
+}
+
+void* reallocarray(void* ptr, size_t nmemb, size_t size) {
+    if(size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return t_usable_size(ptr);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    ensure_initialized();
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return t_aligned_alloc(alignment, size ? size : 1);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if(alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+    int saved_errno = errno;
+    void* ptr = memalign(alignment, size);
+    if(ptr == NULL) return ENOMEM;
+
+    // posix_memalign reports errors through its result and leaves errno alone.
+    errno = saved_errno;
+    *memptr = ptr;
+    return 0;
+}
+
+void* valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if(size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
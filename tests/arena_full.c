@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "tdmm.h"
+
+// Under this cap each of the 16 arenas gets an 8 MiB slice: 4 MiB of heap and 4 MiB of slabs.
+#define AS_LIMIT (512UL * 1024 * 1024)
+#define ARENA_COUNT 16
+
+#define SMALL_SIZE 100
+#define SMALL_TOTAL (8UL * 1024 * 1024)
+#define MEDIUM_SIZE 1000
+#define MEDIUM_TOTAL (24UL * 1024 * 1024)
+
+// Allocates `count` blocks of `size` bytes, filling each with its index. Returns how many it got.
+static size_t fill(void** blocks, size_t count, size_t size) {
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = t_malloc(size);
+        if (!blocks[i]) {
+            perror("t_malloc");
+            return i;
+        }
+        memset(blocks[i], (int)(i & 0xff), size);
+    }
+    return count;
+}
+
+static int check_and_free(void** blocks, size_t count, size_t size) {
+    int failures = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* bytes = blocks[i];
+        if (bytes[0] != (i & 0xff) || bytes[size - 1] != (i & 0xff)) failures++;
+        t_free(blocks[i]);
+    }
+    return failures;
+}
+
+int main(void) {
+    struct rlimit limit = { AS_LIMIT, AS_LIMIT };
+    if (setrlimit(RLIMIT_AS, &limit) != 0) {
+        perror("setrlimit");
+        return 1;
+    }
+    t_init_mt(FIRST_FIT, ARENA_COUNT);
+
+    // The small blocks outgrow the slabs and spill into the heap; the medium ones then find it full.
+    size_t small_count = SMALL_TOTAL / SMALL_SIZE;
+    size_t medium_count = MEDIUM_TOTAL / MEDIUM_SIZE;
+    void** small = calloc(small_count, sizeof(void*));
+    void** medium = calloc(medium_count, sizeof(void*));
+    if (!small || !medium) return 1;
+
+    size_t small_done = fill(small, small_count, SMALL_SIZE);
+    size_t medium_done = fill(medium, medium_count, MEDIUM_SIZE);
+    if (small_done != small_count || medium_done != medium_count) {
+        printf("FAIL: allocated %zu of %zu small and %zu of %zu medium blocks\n",
+               small_done, small_count, medium_done, medium_count);
+        return 1;
+    }
+
+    int failures = check_and_free(small, small_count, SMALL_SIZE) + check_and_free(medium, medium_count, MEDIUM_SIZE);
+    if (failures) {
+        printf("FAIL: %d blocks were overwritten\n", failures);
+        return 1;
+    }
+
+    // Freed space in the full arena is handed out again.
+    void* again = t_malloc(MEDIUM_SIZE);
+    if (!again) {
+        printf("FAIL: no block after freeing everything\n");
+        return 1;
+    }
+    t_free(again);
+
+    printf("PASS: %zu small and %zu medium blocks past a full arena slice\n", small_count, medium_count);
+    free(small);
+    free(medium);
+    return 0;
+}